@@ -0,0 +1,613 @@
+//Micro benchmarks for the chat server, built from the server source without its main()
+
+#define WAZZAPP_NO_MAIN
+#include "server_grp.cpp"
+#include <chrono>
+#include <iomanip>
+#include <random>
+#include <sys/socket.h>
+
+//every heap allocation of the process, counted by the replaced operator new
+//(malloc and free behind new and delete are fine, GCC only sees them paired once the operators are inlined)
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+atomic<uint64_t> allocations{0};
+
+void* operator new(size_t size) {
+    allocations.fetch_add(1, memory_order_relaxed);
+    void* p = malloc(size ? size : 1);
+    if (p == nullptr) {
+        throw bad_alloc();
+    }
+    return p;
+}
+
+void* operator new(size_t size, align_val_t align) {
+    allocations.fetch_add(1, memory_order_relaxed);
+    size_t a = (size_t)align;
+    void* p = aligned_alloc(a, (size + a - 1) / a * a);
+    if (p == nullptr) {
+        throw bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+void operator delete(void* p, align_val_t) noexcept { free(p); }
+void operator delete(void* p, size_t, align_val_t) noexcept { free(p); }
+
+//the single lock every handler used to take, for the before/after comparison
+mutex coarse_mutex;
+
+//a logged in session whose output goes nowhere, sends to /dev/null fail right after entering the kernel
+Session* fake_session(const string& username) {
+    Session* session = new Session();
+    session->sock = open("/dev/null", O_WRONLY);
+    session->username = username;
+    session->user = symbols.intern(username);
+    session->state = LoginState::LoggedIn;
+    return session;
+}
+
+//a logged in session whose output goes through a blocking socket pair, like a client thread's, to a peer that
+//the benchmark drains, so a send costs a real write and waits when the peer falls behind
+Session* sink_session(const string& username, vector<int>& peers) {
+    int sv[2];
+    socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+    fcntl(sv[1], F_SETFL, O_NONBLOCK);
+    peers.push_back(sv[1]);
+    Session* session = fake_session(username);
+    close(session->sock);
+    session->sock = sv[0];
+    return session;
+}
+
+//read everything that arrives on the peers until done is set and they are empty
+void drain_peers(const vector<int>& peers, const atomic<bool>& done) {
+    vector<pollfd> fds;
+    for (int peer : peers) {
+        fds.push_back({peer, POLLIN, 0});
+    }
+    char sink[65536];
+    while (true) {
+        int ready = poll(fds.data(), fds.size(), 10);
+        if (ready == 0 && done.load()) {
+            return;
+        }
+        for (pollfd& fd : fds) {
+            if (fd.revents & POLLIN) {
+                while (recv(fd.fd, sink, sizeof(sink), 0) > 0) {
+                }
+            }
+        }
+    }
+}
+
+//read a slow client's peer: a few hundred bytes every 10 ms, until done is set
+void drain_slowly(int peer, const atomic<bool>& done) {
+    char sink[256];
+    while (!done.load()) {
+        recv(peer, sink, sizeof(sink), 0);
+        this_thread::sleep_for(chrono::milliseconds(10));
+    }
+}
+
+//delete every group, like its last member left, so the next run creates its groups again
+void reset_groups() {
+    for (Symbol id = 0; id < symbols.count.load(); id++) {
+        Group* group = find_group(id);
+        if (group != nullptr) {
+            group->members.clear();
+            group->member_socks.words.clear();
+            group->history = History();
+            group->deleted = true;
+        }
+    }
+}
+
+//every thread sends group messages as its own sender, to its own group or to one group shared by all threads
+//with a slow reader one member of the first thread's group reads its socket slowly, the first thread keeps sending
+//until the others are done and only the others' messages are counted
+double group_messages_per_second(int threads, bool shared_group, bool coarse, int ops, bool slow_reader = false) {
+    vector<Session*> senders;
+    vector<Session*> sessions;
+    vector<int> peers;
+    vector<int> slowPeers;
+    for (int t = 0; t < threads; t++) {
+        string group_name = shared_group ? "shared" : "g" + to_string(t);
+        Symbol group_id = symbols.intern(group_name);
+        senders.push_back(sink_session("sender" + to_string(t), peers));
+        sessions.push_back(senders.back());
+        if (!find_group(group_id) || find_group(group_id)->deleted) {
+            create_group(*senders.back(), group_name);
+            for (int m = 0; m < 8; m++) {
+                bool slow = slow_reader && t == 0 && m == 0;
+                sessions.push_back(sink_session(group_name + "_member" + to_string(m), slow ? slowPeers : peers));
+                if (slow) {
+                    int small = 4096;
+                    setsockopt(sessions.back()->sock, SOL_SOCKET, SO_SNDBUF, &small, sizeof(small));
+                }
+                join_group(*sessions.back(), group_id, group_name);
+            }
+        } else {
+            join_group(*senders.back(), group_id, group_name);
+        }
+    }
+
+    atomic<bool> done{false};
+    atomic<bool> stop{false};
+    thread drainer(drain_peers, cref(peers), cref(done));
+    vector<thread> slowDrainers;
+    for (int peer : slowPeers) {
+        slowDrainers.emplace_back(drain_slowly, peer, cref(done));
+    }
+    auto start = chrono::steady_clock::now();
+    vector<thread> workers;
+    for (int t = 0; t < threads; t++) {
+        workers.emplace_back([&, t] {
+            Session& sender = *senders[t];
+            string group_name = shared_group ? "shared" : "g" + to_string(t);
+            Symbol group_id = symbols.find(group_name);
+            bool endless = slow_reader && t == 0;
+            for (int i = 0; endless ? !stop.load() : i < ops; i++) {
+                if (coarse) {
+                    //the old scheme: one global lock held through the whole handler, the sends included
+                    lock_guard<mutex> lock(coarse_mutex);
+                    vector<Recipient> members;
+                    group_recipients(sender, group_id, members);
+                    fan_out(members, make_msg("[" + group_name + "] " + sender.username + ": hello\n"));
+                    send_to(sender.sock, "Message sent to group " + group_name + ".\n");
+                } else {
+                    group_message(sender, group_id, group_name, "hello");
+                }
+            }
+        });
+    }
+    for (size_t t = slow_reader ? 1 : 0; t < workers.size(); t++) {
+        workers[t].join();
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    stop = true;
+    if (slow_reader) {
+        workers[0].join();
+    }
+    done = true;
+    drainer.join();
+    for (thread& slowDrainer : slowDrainers) {
+        slowDrainer.join();
+    }
+
+    //the next run starts without groups or sockets
+    reset_groups();
+    for (Session* session : sessions) {
+        close(session->sock);
+    }
+    for (int peer : peers) {
+        close(peer);
+    }
+    for (int peer : slowPeers) {
+        close(peer);
+    }
+    return (slow_reader ? threads - 1 : threads) * (double)ops / seconds;
+}
+
+//a logged in session served by an event loop, its output goes to a socket pair whose other end is drained by the benchmark
+Session* loop_session(const string& username, EventLoop* loop, vector<int>& peers) {
+    int sv[2];
+    socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+    fcntl(sv[0], F_SETFL, O_NONBLOCK);
+    fcntl(sv[1], F_SETFL, O_NONBLOCK);
+    peers.push_back(sv[1]);
+    open_socket(sv[0], loop);
+    auto session = make_unique<Session>();
+    session->sock = sv[0];
+    session->loop = loop;
+    session->username = username;
+    session->user = symbols.intern(username);
+    session->state = LoginState::LoggedIn;
+    Session* raw = session.get();
+    socket_slots[sv[0]].session = raw;
+    loop->sessions[sv[0]] = move(session);
+    clients[raw->user] = raw;
+    return raw;
+}
+
+//heap allocations per command once the path is warm: a sender, a private message recipient and a group of 8,
+//with event loops the members are spread over two loops that are driven by hand, inbox and flush included
+double allocations_per_command(bool loops, const string& command, int ops) {
+    vector<Session*> sessions;
+    vector<int> peers;
+    if (loops) {
+        for (int l = 0; l < 2; l++) {
+            event_loops.push_back(make_unique<EventLoop>());
+        }
+        for (int i = 0; i < 10; i++) {
+            sessions.push_back(loop_session("user" + to_string(i), event_loops[i % 2].get(), peers));
+        }
+    } else {
+        for (int i = 0; i < 10; i++) {
+            sessions.push_back(fake_session("user" + to_string(i)));
+            clients[sessions.back()->user] = sessions.back();
+        }
+    }
+    Session& sender = *sessions[0];
+    create_group(sender, "room");
+    for (int i = 2; i < 10; i++) {
+        join_group(*sessions[i], symbols.find("room"), "room");
+    }
+
+    char sink[65536];
+    auto step = [&] {
+        current_loop = loops ? event_loops[0].get() : nullptr;
+        handle_input(sender, command);
+        for (auto& loop : event_loops) {
+            current_loop = loop.get();
+            loop->run_inbox();
+            loop->flush_pending();
+        }
+        for (int peer : peers) {
+            while (recv(peer, sink, sizeof(sink), 0) > 0) {
+            }
+        }
+    };
+    for (int i = 0; i < 1000; i++) {
+        step(); //warm up: first use of the rings, vectors and metrics
+    }
+    uint64_t before = allocations.load();
+    for (int i = 0; i < ops; i++) {
+        step();
+    }
+    double perCommand = (double)(allocations.load() - before) / ops;
+
+    //the next run starts from scratch
+    current_loop = nullptr;
+    reset_groups();
+    clients.clear();
+    for (auto& loop : event_loops) {
+        for (auto& entry : loop->sessions) {
+            socket_slots[entry.first].loop = nullptr;
+            socket_slots[entry.first].session = nullptr;
+            close(entry.first);
+        }
+        close(loop->epfd);
+        close(loop->wakefd);
+    }
+    event_loops.clear();
+    for (int peer : peers) {
+        close(peer);
+    }
+    return perCommand;
+}
+
+//the rfind chain process_message used before the command table, for the before/after comparison
+CommandKind prefix_chain(string_view message) {
+    const char* prefixes[] = {"/msg", "/broadcast", "/create_group", "/join_group", "/leave_group", "/group_msg", "/history", "/grps", "/active", "/logout"};
+    for (int kind = 0; kind < (int)size(prefixes); kind++) {
+        if (message.rfind(prefixes[kind], 0) == 0) {
+            return (CommandKind)kind;
+        }
+    }
+    return CMD_UNKNOWN;
+}
+
+//nanoseconds to find the command of a message (arguments not included, they are split the same way either way)
+double dispatch_ns(bool table, string_view message, int ops) {
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < ops; i++) {
+        CommandKind kind;
+        if (table) {
+            size_t end;
+            const CommandSpec* command = find_command(message, end);
+            kind = command ? command->kind : CMD_UNKNOWN;
+        } else {
+            kind = prefix_chain(message);
+        }
+        asm volatile("" : : "r"(kind) : "memory"); //keep the lookup and read the message again every round
+    }
+    return chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / ops;
+}
+
+//cost of the timer wheel for as many connections as ops: scheduling their timers at random over the next 10 minutes,
+//scheduling them again (what every expiry that finds the connection busy does), and running 10 minutes of ticks
+void report_timers(int ops) {
+    vector<Session> sessions(ops);
+    TimerWheel wheel;
+    uint64_t start = wheel.current * TIMER_TICK_MS * 1000000ull;
+    mt19937_64 rng(7);
+    auto timed = [](auto work) {
+        auto begin = chrono::steady_clock::now();
+        work();
+        return chrono::duration<double, nano>(chrono::steady_clock::now() - begin).count();
+    };
+
+    double scheduleNs = timed([&] {
+        for (Session& session : sessions) {
+            wheel.schedule(session.timer, start + rng() % seconds_ns(600));
+        }
+    });
+    double rescheduleNs = timed([&] {
+        for (Session& session : sessions) {
+            wheel.schedule(session.timer, start + rng() % seconds_ns(600));
+        }
+    });
+    size_t fired = 0;
+    uint64_t ticks = 600 * 1000 / TIMER_TICK_MS;
+    double advanceNs = timed([&] {
+        for (uint64_t tick = 1; tick <= ticks; tick++) {
+            wheel.advance(start + tick * TIMER_TICK_MS * 1000000ull, [&](TimerNode&) { fired++; });
+        }
+    });
+    cout << "timer wheel with " << ops << " connections (" << TIMER_TICK_MS << " ms ticks)\n" << fixed << setprecision(2)
+         << "schedule: " << scheduleNs / ops << " ns, reschedule: " << rescheduleNs / ops << " ns, "
+         << "tick: " << advanceNs / ticks / 1000 << " us (" << fired << " fired in " << ticks << " ticks)\n";
+}
+
+//planning one message to 8 groups of 2000 out of 10,000 clients (a recipient is in about 2 of them): the
+//members of every group one after another, deduplicated through a hash set, and combined as bitsets by FanoutPlan
+void report_fanout(int ops) {
+    const int clientCount = 10000, groupCount = 8, groupSize = 2000;
+    vector<Session> sessions(clientCount);
+    for (int i = 0; i < clientCount; i++) {
+        sessions[i].sock = 1000 + i; //never written to, only the socket numbers are planned
+    }
+    vector<unique_ptr<Group>> groups;
+    mt19937_64 rng(7);
+    for (int g = 0; g < groupCount; g++) {
+        groups.push_back(make_unique<Group>());
+        while ((int)groups.back()->members.size() < groupSize) {
+            groups.back()->add(&sessions[rng() % clientCount]);
+        }
+    }
+    Session& sender = sessions[0];
+    size_t recipients = 0;
+    auto timed = [&](auto plan) {
+        auto begin = chrono::steady_clock::now();
+        for (int i = 0; i < ops; i++) {
+            recipients = plan();
+        }
+        return chrono::duration<double, micro>(chrono::steady_clock::now() - begin).count() / ops;
+    };
+
+    vector<Recipient> list;
+    double perGroupUs = timed([&] {
+        list.clear();
+        for (auto& group : groups) {
+            for (const Member& member : group->members) {
+                if (member.session != &sender) {
+                    list.push_back(member.conn);
+                }
+            }
+        }
+        return list.size();
+    });
+    size_t perGroup = recipients;
+    unordered_set<int> seen;
+    double hashUs = timed([&] {
+        list.clear();
+        seen.clear();
+        seen.insert(sender.sock);
+        for (auto& group : groups) {
+            for (const Member& member : group->members) {
+                if (seen.insert(member.conn.sock).second) {
+                    list.push_back(member.conn);
+                }
+            }
+        }
+        return list.size();
+    });
+    FanoutPlan plan;
+    double bitsetUs = timed([&] {
+        plan.start(sender.sock);
+        for (auto& group : groups) {
+            plan.add(group->member_socks);
+        }
+        return plan.recipients.size();
+    });
+    cout << "planning one message to " << groupCount << " groups of " << groupSize << " out of " << clientCount << " clients (" << ops << " messages)\n"
+         << left << setw(24) << "plan" << right << setw(12) << "us/message" << setw(12) << "recipients" << "\n" << fixed << setprecision(2)
+         << left << setw(24) << "every group" << right << setw(12) << perGroupUs << setw(12) << perGroup << "\n"
+         << left << setw(24) << "hash set" << right << setw(12) << hashUs << setw(12) << list.size() << "\n"
+         << left << setw(24) << "bitsets" << right << setw(12) << bitsetUs << setw(12) << recipients << "\n";
+}
+
+//collecting the recipients of a message to one group of 10,000 members: from a hash set of member sessions, each
+//resolved through its socket's slot like before, and from the group's sorted array of member connections
+void report_members(int ops) {
+    const int memberCount = 10000;
+    vector<unique_ptr<Session>> sessions;
+    unordered_set<Session*> hashed;
+    Group group;
+    for (int i = 0; i < memberCount; i++) {
+        sessions.push_back(make_unique<Session>());
+        sessions.back()->sock = 1000 + i; //never written to
+    }
+    //clients join in no particular order
+    vector<Session*> joins;
+    for (auto& session : sessions) {
+        joins.push_back(session.get());
+    }
+    shuffle(joins.begin(), joins.end(), mt19937_64(7));
+    for (Session* session : joins) {
+        hashed.insert(session);
+        group.add(session);
+    }
+    Session& sender = *sessions[0];
+    vector<Recipient> list;
+    auto timed = [&](auto collect) {
+        auto begin = chrono::steady_clock::now();
+        for (int i = 0; i < ops; i++) {
+            list.clear();
+            collect();
+        }
+        return chrono::duration<double, micro>(chrono::steady_clock::now() - begin).count() / ops;
+    };
+    double hashUs = timed([&] {
+        for (const Session* member : hashed) {
+            if (member != &sender) {
+                list.push_back(recipient_of(member->sock));
+            }
+        }
+    });
+    double flatUs = timed([&] {
+        for (const Member& member : group.members) {
+            if (member.session != &sender) {
+                list.push_back(member.conn);
+            }
+        }
+    });
+    cout << "collecting the recipients of one group of " << memberCount << " members (" << ops << " messages)\n"
+         << left << setw(24) << "members" << right << setw(12) << "us/message" << "\n" << fixed << setprecision(2)
+         << left << setw(24) << "hash set of sessions" << right << setw(12) << hashUs << "\n"
+         << left << setw(24) << "sorted array" << right << setw(12) << flatUs << "\n";
+}
+
+//resolving the group of a /group_msg out of 10,000 groups, the client a member of 20 of them: by name, through the
+//client's set of group names and a locked shard handing out shared pointers as before the names were interned, and by id
+void report_names(int ops) {
+    const int groupCount = 10000, joined = 20;
+    struct NamedShard {
+        shared_mutex lock;
+        NameMap<shared_ptr<Group>> groups;
+    };
+    const size_t shardCount = 64;
+    vector<NamedShard> named(shardCount);
+    NameSet memberships;
+    Session session;
+    vector<string> names;
+    for (int g = 0; g < groupCount; g++) {
+        names.push_back("study-group-" + to_string(g));
+        named[NameHash{}(names.back()) % shardCount].groups.emplace(names.back(), make_shared<Group>());
+        Symbol id = symbols.intern(names.back());
+        symbols.entry(id).group.store(new Group());
+        if (g % (groupCount / joined) == 0) {
+            memberships.insert(names.back());
+            session.join(id);
+        }
+    }
+    vector<string_view> commands;
+    for (string_view name : memberships) {
+        commands.push_back(name);
+    }
+    size_t found = 0;
+    auto timed = [&](auto resolve) {
+        auto begin = chrono::steady_clock::now();
+        for (int i = 0; i < ops; i++) {
+            found += resolve(commands[i % commands.size()]) != nullptr;
+        }
+        return chrono::duration<double, nano>(chrono::steady_clock::now() - begin).count() / ops;
+    };
+    double byNameNs = timed([&](string_view name) -> Group* {
+        if (memberships.find(name) == memberships.end()) {
+            return nullptr;
+        }
+        NamedShard& shard = named[NameHash{}(name) % shardCount];
+        shared_lock<shared_mutex> lock(shard.lock);
+        auto it = shard.groups.find(name);
+        return it == shard.groups.end() ? nullptr : shared_ptr<Group>(it->second).get();
+    });
+    double byIdNs = timed([&](string_view name) -> Group* {
+        Symbol id = symbols.find(name);
+        return session.member_of(id) ? find_group(id) : nullptr;
+    });
+    cout << "resolving the group of a message out of " << groupCount << " groups, " << joined << " joined (" << ops << " lookups each)\n"
+         << left << setw(24) << "lookup" << right << setw(12) << "ns/message" << "\n" << fixed << setprecision(2)
+         << left << setw(24) << "by name" << right << setw(12) << byNameNs << "\n"
+         << left << setw(24) << "interned" << right << setw(12) << byIdNs << "\n";
+}
+
+void report_allocations(int ops) {
+    const char* commands[] = {"/msg user1 hello", "/group_msg room hello", "/history room 4"};
+    cout << "heap allocations per command (" << ops << " commands after warm up)\n";
+    cout << left << setw(24) << "command" << right << setw(12) << "threads" << setw(12) << "epoll" << "\n";
+    for (const char* command : commands) {
+        cout << left << setw(24) << command << right << fixed << setprecision(2)
+             << setw(12) << allocations_per_command(false, command, ops)
+             << setw(12) << allocations_per_command(true, command, ops) << "\n";
+    }
+}
+
+void report_locks(int ops, int maxThreads) {
+    cout << "group messages per second (" << ops << " per thread, 8 members per group)\n";
+    cout << setw(8) << "threads" << setw(18) << "own group/coarse" << setw(18) << "own group/fine" << setw(18) << "shared/coarse" << setw(18) << "shared/fine"
+         << setw(18) << "slow peer/coarse" << setw(18) << "slow peer/fine" << "\n";
+    for (int threads = 1; threads <= maxThreads; threads *= 2) {
+        cout << setw(8) << threads << fixed << setprecision(0)
+             << setw(18) << group_messages_per_second(threads, false, true, ops)
+             << setw(18) << group_messages_per_second(threads, false, false, ops)
+             << setw(18) << group_messages_per_second(threads, true, true, ops)
+             << setw(18) << group_messages_per_second(threads, true, false, ops);
+        if (threads == 1) {
+            cout << setw(18) << "-" << setw(18) << "-" << "\n"; //nobody else to hold up
+            continue;
+        }
+        cout << setw(18) << group_messages_per_second(threads, false, true, ops, true)
+             << setw(18) << group_messages_per_second(threads, false, false, ops, true) << "\n";
+    }
+}
+
+void report_dispatch(int ops) {
+    const char* messages[] = {"/msg user1 hello", "/broadcast hello", "/create_group room", "/join_group room", "/leave_group room", "/group_msg room hello", "/history room 4", "/grps", "/active", "/logout", "/unknown command"};
+    cout << "command dispatch, ns per command (" << ops << " lookups each)\n";
+    cout << left << setw(24) << "command" << right << setw(14) << "rfind chain" << setw(14) << "hash table" << "\n";
+    for (const char* message : messages) {
+        cout << left << setw(24) << message << right << fixed << setprecision(2)
+             << setw(14) << dispatch_ns(false, message, ops)
+             << setw(14) << dispatch_ns(true, message, ops) << "\n";
+    }
+}
+
+//usage: bench_grp [locks|allocs|dispatch|timers|fanout|members|names] [operations] [max threads], every benchmark when none is named
+int main(int argc, char* argv[]) {
+    string which = argc > 1 && !isdigit((unsigned char)argv[1][0]) ? argv[1] : "all";
+    int arg = which == "all" ? 1 : 2;
+    int ops = argc > arg ? atoi(argv[arg]) : 200000;
+    int maxThreads = argc > arg + 1 ? atoi(argv[arg + 1]) : (int)max(1u, thread::hardware_concurrency());
+    if (which != "all" && which != "locks" && which != "allocs" && which != "dispatch" && which != "timers" && which != "fanout" && which != "members" && which != "names") {
+        cerr << "Usage: " << argv[0] << " [locks|allocs|dispatch|timers|fanout|members|names] [operations] [max threads]\n";
+        return 1;
+    }
+
+    socket_slot_count = 1 << 16;
+    socket_slots = make_unique<SocketSlot[]>(socket_slot_count);
+
+    if (which == "all" || which == "allocs") {
+        report_allocations(ops);
+    }
+    if (which == "all") {
+        cout << "\n";
+    }
+    if (which == "all" || which == "dispatch") {
+        report_dispatch(ops * 10);
+    }
+    if (which == "all") {
+        cout << "\n";
+    }
+    if (which == "all" || which == "timers") {
+        report_timers(ops / 2);
+    }
+    if (which == "all") {
+        cout << "\n";
+    }
+    if (which == "all" || which == "fanout") {
+        report_fanout(ops / 100);
+    }
+    if (which == "all") {
+        cout << "\n";
+    }
+    if (which == "all" || which == "members") {
+        report_members(ops / 100);
+    }
+    if (which == "all") {
+        cout << "\n";
+    }
+    if (which == "all" || which == "names") {
+        report_names(ops * 10);
+    }
+    if (which == "all") {
+        cout << "\n";
+    }
+    if (which == "all" || which == "locks") {
+        report_locks(ops, maxThreads);
+    }
+    return 0;
+}
@@ -15,25 +15,107 @@
 
 #define BUFFER_SIZE 1024
 
+// Frame opcode for text in the framed protocol
+#define OP_TEXT 1
+
 std::mutex cout_mutex;
 
-void handle_server_messages(int server_socket) {
+bool framed = false; // Use the framed protocol (varint length + opcode + payload) instead of raw text
+std::string pending; // Received bytes not parsed into frames yet, used by the login steps and then by the receive thread
+
+// Send one message to the server, wrapped in a frame in framed mode
+void send_message(int sock, const std::string& message) {
+    if (!framed) {
+        send(sock, message.c_str(), message.size(), 0);
+        return;
+    }
+    std::string frame;
+    uint64_t len = message.size() + 1; // opcode + payload
+    do {
+        uint8_t byte = len & 0x7f;
+        len >>= 7;
+        frame.push_back(byte | (len ? 0x80 : 0));
+    } while (len);
+    frame.push_back(OP_TEXT);
+    frame += message;
+    send(sock, frame.data(), frame.size(), 0);
+}
+
+// Receive one message from the server: one recv in text mode, one whole frame in framed mode. Returns false on disconnect
+bool recv_message(int sock, std::string& message) {
     char buffer[BUFFER_SIZE];
+    if (!framed) {
+        int bytes_received = recv(sock, buffer, BUFFER_SIZE, 0);
+        if (bytes_received <= 0) {
+            return false;
+        }
+        message.assign(buffer, bytes_received);
+        return true;
+    }
     while (true) {
-        memset(buffer, 0, BUFFER_SIZE);
-        int bytes_received = recv(server_socket, buffer, BUFFER_SIZE, 0);
+        // Parse the varint length, then wait until the whole frame has arrived
+        uint64_t len = 0;
+        size_t used = 0;
+        bool have_len = false;
+        while (used < pending.size() && used < 10) {
+            uint8_t byte = pending[used];
+            len |= uint64_t(byte & 0x7f) << (7 * used);
+            used++;
+            if (!(byte & 0x80)) {
+                have_len = true;
+                break;
+            }
+        }
+        if (have_len && len > 0 && pending.size() - used >= len) {
+            message = pending.substr(used + 1, len - 1); // skip the opcode, the server only sends text
+            pending.erase(0, used + len);
+            return true;
+        }
+        int bytes_received = recv(sock, buffer, BUFFER_SIZE, 0);
         if (bytes_received <= 0) {
+            return false;
+        }
+        pending.append(buffer, bytes_received);
+    }
+}
+
+void handle_server_messages(int server_socket) {
+    std::string message;
+    while (true) {
+        if (!recv_message(server_socket, message)) {
             std::lock_guard<std::mutex> lock(cout_mutex);
             std::cout << "Disconnected from server." << std::endl;
             close(server_socket);
             exit(0);
         }
+        // Answer the server's keepalive pings without showing them, in text mode they may arrive merged with other output
+        bool pinged = false;
+        size_t ping;
+        while ((ping = message.find("/ping\n")) != std::string::npos && (ping == 0 || message[ping - 1] == '\n')) {
+            message.erase(ping, 6);
+            pinged = true;
+        }
+        if (pinged) {
+            send_message(server_socket, "/pong");
+            if (message.empty()) {
+                continue;
+            }
+        }
         std::lock_guard<std::mutex> lock(cout_mutex);
-        std::cout << buffer << std::endl;
+        std::cout << message << std::endl;
     }
 }
 
-int main() {
+int main(int argc, char* argv[]) {
+    for (int i = 1; i < argc; i++) {
+        if (std::string(argv[i]) == "--framed") {
+            framed = true; // The server has to run with --protocol framed as well
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [--framed]" << std::endl;
+            return 1;
+        }
+    }
+
     int client_socket ;
     sockaddr_in server_address{};
 
@@ -56,28 +138,25 @@ int main() {
 
     // Authentication
     std::string username, password;
-    char buffer[BUFFER_SIZE];
+    std::string buffer;
 
-    memset(buffer, 0, BUFFER_SIZE);
-    recv(client_socket, buffer, BUFFER_SIZE, 0); // Receive the message "Enter the user name" for the server
+    recv_message(client_socket, buffer); // Receive the message "Enter the user name" for the server
     // You should have a line like this in the server.cpp code: send_message(client_socket, "Enter username: ");
  
     std::cout << buffer;
     std::getline(std::cin, username);
-    send(client_socket, username.c_str(), username.size(), 0);
+    send_message(client_socket, username);
 
-    memset(buffer, 0, BUFFER_SIZE);
-    recv(client_socket, buffer, BUFFER_SIZE, 0); // Receive the message "Enter the password" for the server
+    recv_message(client_socket, buffer); // Receive the message "Enter the password" for the server
     std::cout << buffer;
     std::getline(std::cin, password);
-    send(client_socket, password.c_str(), password.size(), 0);
+    send_message(client_socket, password);
 
-    memset(buffer, 0, BUFFER_SIZE);
     // Depending on whether the authentication passes or not, receive the message "Authentication Failed" or "Welcome to the server"
-    recv(client_socket, buffer, BUFFER_SIZE, 0); 
+    recv_message(client_socket, buffer);
     std::cout << buffer << std::endl;
 
-    if (std::string(buffer).find("Authentication failed") != std::string::npos) {
+    if (buffer.find("Authentication failed") != std::string::npos) {
         close(client_socket);
         return 1;
     }
@@ -94,7 +173,7 @@ int main() {
 
         if (message.empty()) continue;
 
-        send(client_socket, message.c_str(), message.size(), 0);
+        send_message(client_socket, message);
 
         if (message == "/exit") {
             close(client_socket);
@@ -0,0 +1,682 @@
+//Load generator for the chat server: simulated clients log in with the u<i>:p<i> accounts, drive a mix of
+//commands and report throughput and delivery latency
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <queue>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <cmath>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <csignal>
+#include <unistd.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+using namespace std;
+//maximum number of events handled per epoll_wait call
+#define MAX_EVENTS 256
+//bytes read per recv call
+#define READ_CHUNK 65536
+//frame opcode for text in the framed protocol
+#define OP_TEXT 1
+
+//kinds of commands the simulated clients send
+enum Command { CMD_MSG, CMD_BROADCAST, CMD_GROUP, CMD_JOINLEAVE, CMD_COUNT };
+const char* command_names[CMD_COUNT] = {"msg", "broadcast", "group", "joinleave"};
+
+//startup configuration, filled from the command line
+struct LoadConfig {
+    string host = "127.0.0.1";
+    int port = 12345;
+    int clients = 1000; //simulated clients
+    int first = 0; //account number of the first client, u<first> .. u<first + clients - 1>
+    int threads = 1; //epoll threads driving the clients
+    double rate = 5; //commands per second per client
+    double duration = 10; //seconds of measurement
+    double setup_timeout = 60; //seconds to wait for every client to log in and join its group
+    int groups = 100; //clients are spread over this many groups lg0 .. lg<groups - 1>
+    size_t size = 32; //payload bytes per message
+    bool framed = false; //use the framed protocol, the server must run with --protocol framed
+    int mix[CMD_COUNT] = {70, 1, 25, 4}; //relative weights of the commands
+    bool storm = false; //log in, log out and log in again as fast as the server answers instead of sending commands
+};
+LoadConfig config;
+
+//set once every client is ready, cleared to stop sending, and done ends the threads
+atomic<bool> running{false};
+atomic<bool> stopping{false};
+atomic<bool> done{false};
+atomic<uint64_t> measure_start{0};
+atomic<int> ready_clients{0};
+atomic<int> failed_clients{0};
+
+uint64_t now_ns() {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+//log-linear latency histogram in nanoseconds: 16 linear buckets per power of two, about 6% resolution
+struct Histogram {
+    uint64_t counts[64 * 16] = {};
+    uint64_t total = 0;
+    uint64_t max = 0;
+
+    static int index(uint64_t v) {
+        if (v < 16) {
+            return (int)v;
+        }
+        int e = 63 - __builtin_clzll(v);
+        return (e - 3) * 16 + (int)((v >> (e - 4)) & 15);
+    }
+    //largest value that falls into bucket i
+    static uint64_t upper(int i) {
+        if (i < 16) {
+            return i;
+        }
+        int e = i / 16 + 3;
+        return ((uint64_t)(16 + i % 16 + 1) << (e - 4)) - 1;
+    }
+    void record(uint64_t v) {
+        counts[index(v)]++;
+        total++;
+        max = std::max(max, v);
+    }
+    void merge(const Histogram& other) {
+        for (int i = 0; i < 64 * 16; i++) {
+            counts[i] += other.counts[i];
+        }
+        total += other.total;
+        max = std::max(max, other.max);
+    }
+    uint64_t percentile(double p) const {
+        uint64_t rank = std::max<uint64_t>(1, (uint64_t)ceil(p * total));
+        uint64_t seen = 0;
+        for (int i = 0; i < 64 * 16; i++) {
+            seen += counts[i];
+            if (seen >= rank) {
+                return std::min(upper(i), max);
+            }
+        }
+        return max;
+    }
+};
+
+//per thread results, merged at the end
+struct Stats {
+    uint64_t sent[CMD_COUNT] = {};
+    uint64_t delivered = 0; //messages with a timestamp received by any client
+    uint64_t errors = 0; //error replies from the server while measuring
+    uint64_t disconnected = 0; //ready clients the server disconnected
+    uint64_t logins = 0; //logins completed while measuring (--storm)
+    Histogram latency;
+    Histogram login_latency; //from sending the password to the welcome (--storm)
+};
+
+//login and setup steps of a simulated client
+enum class Phase { Connecting, Username, Password, Welcome, Joining, Ready, Closed };
+
+struct Client {
+    int fd = -1;
+    int account = 0;
+    int group = 0;
+    Phase phase = Phase::Connecting;
+    bool member = false; //member of its group lg<group>
+    bool need_create = false; //the group was deleted, the next join creates it
+    bool waiting = false; //a create/join/leave reply is outstanding
+    string frames; //received bytes not parsed into frames yet (framed protocol)
+    string text; //received text not split into lines yet
+    string out; //bytes the socket did not take yet
+    uint64_t next_send = 0;
+    uint64_t password_sent = 0; //--storm: when the password of the current login went out
+    int logins = 0; //--storm: logins of this client so far
+};
+
+//one epoll thread driving a share of the clients
+struct Worker {
+    int epfd = -1;
+    vector<Client> clients;
+    Stats stats;
+    mt19937_64 rng;
+    priority_queue<pair<uint64_t, int>, vector<pair<uint64_t, int>>, greater<>> timers; //next send time > client
+    uint64_t interval = 0; //nanoseconds between two commands of a client
+
+    void run();
+    void start(int index);
+    void on_event(int index, uint32_t events);
+    void receive(Client& c);
+    void handle_text(Client& c);
+    void handle_line(Client& c, string_view line);
+    void send_command(Client& c);
+    void send_message(Client& c, const string& message);
+    void flush(Client& c);
+    void close_client(Client& c, bool failed);
+};
+
+//connect a client, the login continues once the server prompts for the username
+void Worker::start(int index) {
+    Client& c = clients[index];
+    c.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (c.fd == -1) {
+        close_client(c, true);
+        return;
+    }
+    int on = 1;
+    setsockopt(c.fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(config.port);
+    inet_pton(AF_INET, config.host.c_str(), &addr.sin_addr);
+    if (connect(c.fd, (sockaddr*)&addr, sizeof(addr)) == -1 && errno != EINPROGRESS) {
+        close_client(c, true);
+        return;
+    }
+    epoll_event ev{};
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.u32 = index;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, c.fd, &ev);
+}
+
+void Worker::close_client(Client& c, bool failed) {
+    if (c.phase == Phase::Closed) {
+        return;
+    }
+    if (c.phase == Phase::Ready) {
+        stats.disconnected++;
+    } else if (failed) {
+        failed_clients++;
+    }
+    c.phase = Phase::Closed;
+    if (c.fd != -1) {
+        close(c.fd);
+        c.fd = -1;
+    }
+}
+
+//queue one message, wrapped in a frame in framed mode, and write as much as the socket takes
+void Worker::send_message(Client& c, const string& message) {
+    if (config.framed) {
+        uint64_t len = message.size() + 1; //opcode + payload
+        do {
+            uint8_t byte = len & 0x7f;
+            len >>= 7;
+            c.out.push_back(byte | (len ? 0x80 : 0));
+        } while (len);
+        c.out.push_back(OP_TEXT);
+    }
+    c.out += message;
+    flush(c);
+}
+
+void Worker::flush(Client& c) {
+    while (!c.out.empty()) {
+        ssize_t written = send(c.fd, c.out.data(), c.out.size(), MSG_NOSIGNAL);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                close_client(c, true);
+            }
+            return; //the rest goes out on the next EPOLLOUT edge
+        }
+        c.out.erase(0, written);
+    }
+}
+
+void Worker::on_event(int index, uint32_t events) {
+    Client& c = clients[index];
+    if (c.phase == Phase::Closed) {
+        return;
+    }
+    if (c.phase == Phase::Connecting && (events & EPOLLOUT)) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(c.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err != 0) {
+            close_client(c, true);
+            return;
+        }
+        c.phase = Phase::Username;
+    }
+    if (events & EPOLLOUT) {
+        flush(c);
+    }
+    if (c.phase != Phase::Closed && (events & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP))) {
+        receive(c);
+    }
+}
+
+//read until the socket is drained, then hand the text to the login steps or the line parser
+void Worker::receive(Client& c) {
+    char buffer[READ_CHUNK];
+    while (true) {
+        ssize_t n = recv(c.fd, buffer, sizeof(buffer), 0);
+        if (n > 0) {
+            if (config.framed) {
+                c.frames.append(buffer, n);
+            } else {
+                c.text.append(buffer, n);
+            }
+            continue;
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        handle_text(c);
+        close_client(c, true);
+        return;
+    }
+
+    //framed mode: move whole frames into the text, the server only sends text frames
+    size_t pos = 0;
+    while (config.framed) {
+        uint64_t len = 0;
+        size_t used = 0;
+        bool have_len = false;
+        while (pos + used < c.frames.size() && used < 10) {
+            uint8_t byte = c.frames[pos + used];
+            len |= uint64_t(byte & 0x7f) << (7 * used);
+            used++;
+            if (!(byte & 0x80)) {
+                have_len = true;
+                break;
+            }
+        }
+        if (!have_len || c.frames.size() - pos - used < len) {
+            break;
+        }
+        if (len > 0) {
+            c.text.append(c.frames, pos + used + 1, len - 1);
+        }
+        pos += used + len;
+    }
+    c.frames.erase(0, pos);
+    handle_text(c);
+}
+
+void Worker::handle_text(Client& c) {
+    string account = to_string(c.account);
+    switch (c.phase) {
+    case Phase::Username:
+        if (c.text.find("Enter the username") != string::npos) {
+            c.text.clear();
+            c.phase = Phase::Password;
+            send_message(c, "u" + account);
+        }
+        return;
+    case Phase::Password:
+        if (c.text.find("Error:") != string::npos) {
+            close_client(c, true);
+        } else if (c.text.find("Enter the password") != string::npos) {
+            c.text.clear();
+            c.phase = Phase::Welcome;
+            c.password_sent = now_ns();
+            send_message(c, "p" + account);
+        }
+        return;
+    case Phase::Welcome:
+        if (c.text.find("Error:") != string::npos) {
+            close_client(c, true);
+        } else if (c.text.find("Welcome to the chat server") != string::npos && config.storm) {
+            //login storm: log out right away and log in again on the prompt that follows
+            c.text.clear();
+            if (c.logins++ == 0) {
+                ready_clients++;
+            }
+            if (running.load(memory_order_relaxed) && !stopping.load(memory_order_relaxed)) {
+                stats.logins++;
+                stats.login_latency.record(now_ns() - c.password_sent);
+            }
+            c.phase = Phase::Username;
+            send_message(c, "/logout");
+        } else if (c.text.find("Welcome to the chat server") != string::npos) {
+            c.text.clear();
+            c.phase = Phase::Joining;
+            c.waiting = true;
+            send_message(c, "/join_group lg" + to_string(c.group));
+        }
+        return;
+    case Phase::Joining:
+    case Phase::Ready: {
+        size_t start = 0;
+        size_t end;
+        while ((end = c.text.find('\n', start)) != string::npos) {
+            handle_line(c, string_view(c.text).substr(start, end - start));
+            start = end + 1;
+        }
+        c.text.erase(0, start);
+        return;
+    }
+    default:
+        return;
+    }
+}
+
+//a line of server output: timestamped messages are counted, replies to create/join/leave track the membership
+void Worker::handle_line(Client& c, string_view line) {
+    bool measuring = running.load(memory_order_relaxed);
+    if (line == "/ping") {
+        send_message(c, "/pong"); //keepalive of a server with --ping-interval, slow senders would be idle otherwise
+        return;
+    }
+    size_t at = 0;
+    while ((at = line.find('@', at)) != string_view::npos) {
+        at++;
+        uint64_t sent = strtoull(line.data() + at, nullptr, 10);
+        if (sent >= measure_start.load(memory_order_relaxed) && sent > 0) {
+            stats.latency.record(now_ns() - sent);
+            stats.delivered++;
+        }
+    }
+
+    //replies name the group as " lg<n> " or " lg<n>."
+    string group = " lg" + to_string(c.group);
+    size_t named = line.find(group);
+    bool reply = named != string_view::npos && named + group.size() < line.size() && (line[named + group.size()] == ' ' || line[named + group.size()] == '.');
+    if (reply && (line.find("You have successfully joined") != string_view::npos || line.find("created successfully") != string_view::npos)) {
+        c.member = true;
+        c.need_create = false;
+        c.waiting = false;
+    } else if (reply && (line.find("You have successfully left") != string_view::npos || line.find("has been deleted") != string_view::npos)) {
+        c.member = false;
+        c.need_create = line.find("has been deleted") != string_view::npos;
+        c.waiting = false;
+    } else if (reply && line.find("Error: Group") != string_view::npos) {
+        //the group does not exist (create it) or exists (join it)
+        c.need_create = line.find("does not exist") != string_view::npos;
+        c.waiting = false;
+        if (c.phase == Phase::Joining) {
+            c.waiting = true;
+            send_message(c, string(c.need_create ? "/create_group" : "/join_group") + " lg" + to_string(c.group));
+        }
+    } else if (line.find("Error:") != string_view::npos && measuring) {
+        stats.errors++;
+    }
+
+    //the client starts sending once it is in its group
+    if (c.phase == Phase::Joining && c.member) {
+        c.phase = Phase::Ready;
+        ready_clients++;
+        c.next_send = now_ns() + rng() % interval;
+        timers.emplace(c.next_send, &c - clients.data());
+    }
+}
+
+//send the next command of the mix, every message carries its send time as @<nanoseconds>
+void Worker::send_command(Client& c) {
+    int total = 0;
+    for (int weight : config.mix) {
+        total += weight;
+    }
+    int pick = (int)(rng() % total);
+    int command = 0;
+    while (pick >= config.mix[command]) {
+        pick -= config.mix[command];
+        command++;
+    }
+    if (command == CMD_GROUP && !c.member) {
+        command = CMD_JOINLEAVE;
+    }
+    if (command == CMD_JOINLEAVE && c.waiting) {
+        return; //the previous join/leave has not been answered yet
+    }
+
+    string payload(config.size > 24 ? config.size - 24 : 0, 'x');
+    payload += "@" + to_string(now_ns()) + ";";
+    string group = "lg" + to_string(c.group);
+    switch (command) {
+    case CMD_MSG: {
+        int target = config.first + (int)(rng() % config.clients);
+        send_message(c, "/msg u" + to_string(target) + " " + payload + "\n");
+        break;
+    }
+    case CMD_BROADCAST:
+        send_message(c, "/broadcast " + payload + "\n");
+        break;
+    case CMD_GROUP:
+        send_message(c, "/group_msg " + group + " " + payload);
+        break;
+    default:
+        c.waiting = true;
+        send_message(c, string(c.member ? "/leave_group " : c.need_create ? "/create_group " : "/join_group ") + group);
+        break;
+    }
+    stats.sent[command]++;
+}
+
+void Worker::run() {
+    epfd = epoll_create1(0);
+    for (size_t i = 0; i < clients.size(); i++) {
+        start((int)i);
+    }
+
+    epoll_event events[MAX_EVENTS];
+    while (!done.load()) {
+        //wake up for the next due command, or every 100 ms to check for the end
+        uint64_t now = now_ns();
+        int timeout = 100;
+        if (!timers.empty() && running.load()) {
+            timeout = timers.top().first <= now ? 0 : (int)min<uint64_t>(100, (timers.top().first - now) / 1000000 + 1);
+        }
+        int n = epoll_wait(epfd, events, MAX_EVENTS, timeout);
+        for (int i = 0; i < n; i++) {
+            on_event((int)events[i].data.u32, events[i].events);
+        }
+
+        //send the due commands, a client that fell behind skips ahead instead of sending a burst
+        if (!running.load() || stopping.load()) {
+            continue;
+        }
+        now = now_ns();
+        while (!timers.empty() && timers.top().first <= now) {
+            Client& c = clients[timers.top().second];
+            timers.pop();
+            if (c.phase != Phase::Ready) {
+                continue;
+            }
+            send_command(c);
+            c.next_send = max(c.next_send + interval, now);
+            timers.emplace(c.next_send, &c - clients.data());
+        }
+    }
+    for (Client& c : clients) {
+        if (c.fd != -1) {
+            close(c.fd);
+        }
+    }
+    close(epfd);
+}
+
+void print_usage(const char* prog) {
+    cerr << "Usage: " << prog << " [options]\n"
+         << "  --host ADDR            server address (default: 127.0.0.1)\n"
+         << "  --port N               server port (default: 12345)\n"
+         << "  --clients N            simulated clients (default: 1000)\n"
+         << "  --first N              first account, clients log in as u<first>.. with password p<first>.. (default: 0)\n"
+         << "  --threads N            epoll threads driving the clients (default: 1)\n"
+         << "  --rate R               commands per second per client (default: 5)\n"
+         << "  --duration SECONDS     length of the measurement (default: 10)\n"
+         << "  --setup-timeout SECONDS  time allowed for logging in and joining the groups (default: 60)\n"
+         << "  --groups N             number of groups lg0.. the clients are spread over (default: 100)\n"
+         << "  --size BYTES           message payload size (default: 32)\n"
+         << "  --mix LIST             command weights, e.g. msg=70,broadcast=1,group=25,joinleave=4 (the default)\n"
+         << "  --framed               use the framed protocol (server started with --protocol framed)\n"
+         << "  --storm                every client logs in, logs out and logs in again, reports logins per second\n";
+}
+
+//parse msg=70,broadcast=1,... into config.mix, commands left out get weight 0
+bool parse_mix(const string& list) {
+    int mix[CMD_COUNT] = {};
+    size_t start = 0;
+    while (start < list.size()) {
+        size_t end = list.find(',', start);
+        if (end == string::npos) {
+            end = list.size();
+        }
+        string item = list.substr(start, end - start);
+        size_t eq = item.find('=');
+        if (eq == string::npos) {
+            return false;
+        }
+        string name = item.substr(0, eq);
+        int command = 0;
+        while (command < CMD_COUNT && name != command_names[command]) {
+            command++;
+        }
+        if (command == CMD_COUNT || atoi(item.c_str() + eq + 1) < 0) {
+            return false;
+        }
+        mix[command] = atoi(item.c_str() + eq + 1);
+        start = end + 1;
+    }
+    int total = 0;
+    for (int i = 0; i < CMD_COUNT; i++) {
+        config.mix[i] = mix[i];
+        total += mix[i];
+    }
+    return total > 0;
+}
+
+//parse the command line into config, returns false on invalid arguments
+bool parse_args(int argc, char* argv[]) {
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--host" && has_value) {
+            config.host = argv[++i];
+        } else if (arg == "--port" && has_value) {
+            config.port = atoi(argv[++i]);
+        } else if (arg == "--clients" && has_value) {
+            config.clients = atoi(argv[++i]);
+        } else if (arg == "--first" && has_value) {
+            config.first = atoi(argv[++i]);
+        } else if (arg == "--threads" && has_value) {
+            config.threads = atoi(argv[++i]);
+        } else if (arg == "--rate" && has_value) {
+            config.rate = atof(argv[++i]);
+        } else if (arg == "--duration" && has_value) {
+            config.duration = atof(argv[++i]);
+        } else if (arg == "--setup-timeout" && has_value) {
+            config.setup_timeout = atof(argv[++i]);
+        } else if (arg == "--groups" && has_value) {
+            config.groups = atoi(argv[++i]);
+        } else if (arg == "--size" && has_value) {
+            config.size = atol(argv[++i]);
+        } else if (arg == "--mix" && has_value) {
+            if (!parse_mix(argv[++i])) {
+                return false;
+            }
+        } else if (arg == "--framed") {
+            config.framed = true;
+        } else if (arg == "--storm") {
+            config.storm = true;
+        } else {
+            return false;
+        }
+    }
+    return config.port > 0 && config.clients > 0 && config.first >= 0 && config.threads > 0 && config.rate > 0 && config.duration > 0 && config.groups > 0;
+}
+
+int main(int argc, char* argv[]) {
+    if (!parse_args(argc, argv)) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    //every client needs a socket
+    rlimit limit{};
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+    if ((rlim_t)config.clients + 64 > limit.rlim_cur) {
+        cerr << "Warning: the open file limit (" << limit.rlim_cur << ") is too low for " << config.clients << " clients\n";
+    }
+
+    //client i belongs to thread i % threads, and to group lg<i % groups>
+    vector<unique_ptr<Worker>> workers;
+    for (int t = 0; t < config.threads; t++) {
+        workers.push_back(make_unique<Worker>());
+        workers.back()->rng.seed(t * 7919 + 1);
+        workers.back()->interval = (uint64_t)(1e9 / config.rate);
+    }
+    for (int i = 0; i < config.clients; i++) {
+        Client c;
+        c.account = config.first + i;
+        c.group = i % config.groups;
+        workers[i % config.threads]->clients.push_back(move(c));
+    }
+    vector<thread> threads;
+    for (auto& worker : workers) {
+        threads.emplace_back(&Worker::run, worker.get());
+    }
+
+    //wait until every client is logged in and in its group
+    auto setup_start = chrono::steady_clock::now();
+    double setup_seconds = 0;
+    while (ready_clients.load() + failed_clients.load() < config.clients && setup_seconds < config.setup_timeout) {
+        this_thread::sleep_for(chrono::milliseconds(50));
+        setup_seconds = chrono::duration<double>(chrono::steady_clock::now() - setup_start).count();
+    }
+    cout << "setup: " << ready_clients.load() << " of " << config.clients << (config.storm ? " clients logged in" : " clients logged in and joined their groups") << " in "
+         << fixed << setprecision(2) << setup_seconds << " s (" << failed_clients.load() << " failed)" << endl;
+
+    //measure, then stop sending and give the last messages time to arrive
+    measure_start.store(now_ns());
+    running.store(true);
+    this_thread::sleep_for(chrono::duration<double>(config.duration));
+    stopping.store(true);
+    this_thread::sleep_for(chrono::milliseconds(500));
+    done.store(true);
+    for (thread& t : threads) {
+        t.join();
+    }
+
+    Stats total;
+    for (auto& worker : workers) {
+        for (int i = 0; i < CMD_COUNT; i++) {
+            total.sent[i] += worker->stats.sent[i];
+        }
+        total.delivered += worker->stats.delivered;
+        total.errors += worker->stats.errors;
+        total.disconnected += worker->stats.disconnected;
+        total.logins += worker->stats.logins;
+        total.latency.merge(worker->stats.latency);
+        total.login_latency.merge(worker->stats.login_latency);
+    }
+    auto ms = [](uint64_t ns) { return ns / 1e6; };
+    if (config.storm) {
+        cout << "logins: " << total.logins << " in " << setprecision(2) << config.duration << " s, " << setprecision(0) << total.logins / config.duration << "/s\n";
+        cout << setprecision(3) << "login latency: p50 " << ms(total.login_latency.percentile(0.5)) << " ms, p99 " << ms(total.login_latency.percentile(0.99))
+             << " ms, p999 " << ms(total.login_latency.percentile(0.999)) << " ms, max " << ms(total.login_latency.max) << " ms\n";
+        cout << "failed: " << failed_clients.load() << endl;
+        return 0;
+    }
+    uint64_t commands = 0;
+    for (uint64_t sent : total.sent) {
+        commands += sent;
+    }
+    cout << "commands: " << commands << " in " << setprecision(2) << config.duration << " s, " << setprecision(0) << commands / config.duration << "/s (";
+    for (int i = 0; i < CMD_COUNT; i++) {
+        cout << (i ? ", " : "") << command_names[i] << " " << total.sent[i];
+    }
+    cout << ")\n";
+    cout << "deliveries: " << total.delivered << ", " << total.delivered / config.duration << "/s\n";
+    cout << setprecision(3) << "delivery latency: p50 " << ms(total.latency.percentile(0.5)) << " ms, p99 " << ms(total.latency.percentile(0.99))
+         << " ms, p999 " << ms(total.latency.percentile(0.999)) << " ms, max " << ms(total.latency.max) << " ms\n";
+    cout << "error replies: " << total.errors << ", disconnected: " << total.disconnected << endl;
+    return 0;
+}
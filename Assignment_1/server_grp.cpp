@@ -14,519 +14,5536 @@
 #include <unordered_set>
 #include <thread>
 #include <mutex>
+#include <shared_mutex>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <algorithm>
+#include <atomic>
+#include <string_view>
+#include <span>
+#include <array>
+#include <charconv>
+#include <sys/uio.h>
+#include <deque>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+#include <cerrno>
+#include <csignal>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <map>
+#include <condition_variable>
+#include <chrono>
+#include <sstream>
+#include <ctime>
+#include <cstdio>
+#include <future>
+#include <crypt.h>
+#include <bit>
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <poll.h>
+#include <sys/signalfd.h>
+#include <sys/un.h>
 using namespace std;
 //defining port number
 #define PORT 12345
 //defining buffer size
 #define BUFFER_SIZE 1024
+//maximum number of events handled per epoll_wait call
+#define MAX_EVENTS 256
+//number of independently locked shards of the login failure counts
+#define THROTTLE_SHARDS 64
+//names of the symbol table per page, and the most pages it can have
+#define SYMBOL_PAGE 4096
+#define SYMBOL_PAGES 16384
+//number of copies of the metrics, every thread adds to its own copy
+#define METRIC_STRIPES 64
+//buckets of a metrics histogram, 4 per power of two
+#define HISTOGRAM_BUCKETS 256
+//records in the log ring (a power of two) and the bytes of arguments a record holds
+#define LOG_RING_SIZE 16384
+#define LOG_RECORD_BYTES 232
+//a stored offline message was delivered (StoreRecord::flags)
+#define STORE_DELIVERED 1
+//slots of the command table's perfect hash (a power of two, at least the number of commands)
+#define COMMAND_SLOTS 32
+//size classes of the message pools and the free blocks a thread keeps per class
+#define MSG_POOL_CLASSES 4
+#define MSG_POOL_DEPTH 1024
 
-//data management
-unordered_map<string, int>clients; //unordered map, username > client socket
-unordered_map<string, string>users; //unordered map, client username > password
-unordered_map<string, unordered_set<int>>groups; //unordered map, group name > client socket
-//Mutex for thread-safe access
-mutex client_mutex; 
+//bytes asked from the kernel per recv in framed mode
+#define READ_CHUNK 16384
 
-//create a group
-void create_group(int sock, const string& group_name){ //takes the socket number and group name to create a group with client as first member
-    
-    //lock the mutex using std::lock_guard
-    lock_guard<mutex> lock(client_mutex);
+//timer wheel: a tick of 100 ms, 4 levels of 64 slots cover 64^4 ticks (about 19 days)
+#define TIMER_TICK_MS 100
+#define TIMER_LEVELS 4
+#define TIMER_SLOT_BITS 6
 
-    //checks if group already exists
-    if (groups.find(group_name) != groups.end()) {
-        string errorMsg = "Error: Group " + group_name + " already exists!\n";
-        send(sock, errorMsg.c_str(), errorMsg.size(), 0);
-        return;
-    }
-    //add client as first member
-    groups[group_name].insert(sock);
+//io_uring backend: submission queue entries, completion queue entries and receive buffers per event loop
+#define URING_ENTRIES 4096
+#define URING_CQ_ENTRIES 16384
+#define URING_BUFFERS 1024
 
-    //inform client
-    string successMsg = "Group " + group_name + " created successfully, and you are added as the first member.\n";
-    send(sock, successMsg.c_str(), successMsg.size(), 0);
-}
+//hot restart: version of the handoff exchange, bytes of state per message, sockets per message, seconds either process
+//waits for the other, and milliseconds the old process may take to stop its clients
+#define HANDOFF_VERSION 1
+#define HANDOFF_CHUNK 65536
+#define HANDOFF_FDS 250
+#define HANDOFF_TIMEOUT 10
+#define HANDOFF_FREEZE_MS 3000
 
-//join a group
-void join_group(int sock, const string& group_name) { //takes the socket number and group name to add client as member
-    
-    //lock the mutex using std::lock_guard
-    lock_guard<mutex> lock(client_mutex);
+//threading model selected at startup
+enum class ServerMode { Threads, Epoll, Uring };
 
-    //checks if group exists
-    auto it = groups.find(group_name);
-    if (it == groups.end()) {
-        string errorMsg = "Error: Group " + group_name + " does not exist!\n";
-        send(sock, errorMsg.c_str(), errorMsg.size(), 0);
-        return;
+//wire protocol selected at startup
+enum class Protocol { Text, Framed };
+
+//what happens to a new message for a client whose outbound queue is full
+enum class Backpressure {
+    Drop, //the new message is dropped for that client
+    Disconnect, //the client is disconnected
+    Coalesce, //the oldest unsent messages make room for the new one, unsent messages are merged into one buffer when out of slots
+};
+
+//log levels, records below --log-level are skipped before anything is copied
+enum class LogLevel : uint8_t { Debug, Info, Warn, Error, Off };
+
+//commands counted by the metrics and rate limited by kind
+enum CommandKind { CMD_MSG, CMD_BROADCAST, CMD_CREATE_GROUP, CMD_JOIN_GROUP, CMD_LEAVE_GROUP, CMD_GROUP_MSG, CMD_MULTI_GROUP_MSG, CMD_HISTORY, CMD_GRPS, CMD_ACTIVE, CMD_LOGOUT, CMD_PING, CMD_UNKNOWN, CMD_KINDS };
+const char* command_labels[CMD_KINDS] = {"msg", "broadcast", "create_group", "join_group", "leave_group", "group_msg", "multi_group_msg", "history", "grps", "active", "logout", "ping", "unknown"};
+
+//token bucket limit: commands per second, and how many may come at once after a quiet period
+struct RateLimit {
+    double rate = 0; //0 is unlimited
+    double burst = 0;
+};
+
+//startup configuration, filled from the command line
+struct ServerConfig {
+    int port = PORT; //listening port
+    ServerMode mode = ServerMode::Threads;
+    int loops = max(1u, thread::hardware_concurrency()); //number of event loop threads in epoll mode
+    bool reuseport = false; //every event loop accepts on its own SO_REUSEPORT socket
+    string users_file = "users.txt"; //credentials, loaded at startup and reloaded when the file changes
+    Protocol protocol = Protocol::Text; //text: every recv is one command, framed: varint length + opcode + payload
+    size_t max_frame = 1 << 20; //largest accepted frame in framed mode
+    size_t queue_slots = 1024; //messages an event loop queues per client before backpressure kicks in
+    size_t queue_bytes = 4 << 20; //bytes an event loop queues per client before backpressure kicks in
+    Backpressure backpressure = Backpressure::Drop;
+    size_t zerocopy = 0; //in epoll mode messages of at least this many bytes are sent with MSG_ZEROCOPY, 0 turns it off
+    int admin_port = 0; //port on 127.0.0.1 serving the metrics in Prometheus text format, 0 turns it off
+    LogLevel log_level = LogLevel::Info; //every received message is logged at info level
+    size_t history_messages = 32; //recent messages kept per group for /history, 0 turns history off
+    size_t history_bytes = 4096; //bytes of recent messages kept per group
+    string store_dir; //directory of the offline message store, empty turns it off
+    size_t store_segment = 64 << 20; //bytes per store segment file
+    int workers = 0; //threads running the clients' commands in epoll mode, 0 runs them on the event loops
+    RateLimit rate_limits[CMD_KINDS + 1]; //per client, by command kind, the last one counts every command together
+    int max_connections = 0; //connections refused right after accept while this many are open, 0 is unlimited
+    int max_groups = 100000; //groups ever created, deleted ones included since a group and its name are kept, 0 is unlimited
+    int login_attempts = 3; //failed logins before a connection is closed, 0 is unlimited
+    int login_throttle = 0; //failed logins for a username within login_window after which its logins are refused, 0 turns it off
+    int login_window = 60; //seconds
+    int login_timeout = 60; //seconds a connection may take to log in, 0 is unlimited
+    int idle_timeout = 300; //seconds without input after which a connection is closed, 0 is unlimited
+    int ping_interval = 60; //seconds without input after which a logged in client is pinged, 0 turns pings off
+    int verify_threads = max(1u, thread::hardware_concurrency()); //threads checking password hashes
+    int hash_cost = 5; //yescrypt cost of the hashes written by --hash-users
+    int drain_timeout = 10; //seconds a shutdown waits for the clients' output to be written
+    string handoff_path; //UNIX socket a new server process takes the clients over on, empty turns hot restart off
+
+    ServerConfig() {
+        rate_limits[CMD_BROADCAST] = {5, 20}; //a broadcast reaches every client, flooding it is the cheapest way to load the server
     }
+};
+ServerConfig config;
 
-    //add client as member
-    it->second.insert(sock);
 
-    //inform client
-    string successMsg = "You have successfully joined the group " + group_name + ".\n";
-    send(sock, successMsg.c_str(), successMsg.size(), 0);
+//HDR style histogram: 4 linear buckets per power of two, so a bucket is never wider than a quarter of its values
+struct Histogram {
+    atomic<uint64_t> buckets[HISTOGRAM_BUCKETS];
+    atomic<uint64_t> sum;
 
-    // Find the username associated with the client socket
-    string username;
-    for (const auto& client : clients) {
-        if (client.second == sock) {
-            username = client.first;
-            break;
+    static int index(uint64_t value) {
+        if (value < 4) {
+            return (int)value;
         }
+        int e = 63 - __builtin_clzll(value);
+        return (e - 1) * 4 + (int)((value >> (e - 2)) & 3);
     }
-
-    // Send a group message to all members of the group informing them of who has joined
-    string joinMsg = username + " has joined the group " + group_name + ".\n";
-    for (const auto& memberSock : it->second) {
-        if (memberSock != sock) { // Skip sending the message to the joining client
-            send(memberSock, joinMsg.c_str(), joinMsg.size(), 0);
+    //largest value counted in bucket i
+    static uint64_t upper(int i) {
+        if (i < 4) {
+            return i;
         }
+        int e = i / 4 + 1;
+        return ((uint64_t)(4 + i % 4 + 1) << (e - 2)) - 1;
     }
-}
+    void record(uint64_t value) {
+        buckets[index(value)].fetch_add(1, memory_order_relaxed);
+        sum.fetch_add(value, memory_order_relaxed);
+    }
+};
 
-//leave group
-void leave_group(int sock, const std::string& group_name) { //takes the socket number and group name to remove client as member
-    
-    //lock the mutex using std::lock_guard
-    lock_guard<mutex> lock(client_mutex);
+//one copy of every counter and histogram, cache line aligned so that threads never write to the same line
+struct alignas(64) MetricStripe {
+    atomic<uint64_t> connections; //sockets accepted
+    atomic<uint64_t> disconnects; //sockets closed
+    atomic<uint64_t> logins; //successful logins
+    atomic<uint64_t> logouts; //logged in clients that logged out or disconnected
+    atomic<uint64_t> login_failures; //wrong passwords
+    atomic<uint64_t> logins_throttled; //logins refused by --login-throttle
+    atomic<uint64_t> connections_rejected; //connections refused by --max-connections
+    atomic<uint64_t> rate_limited; //commands refused by --rate-limit
+    atomic<uint64_t> login_timeouts; //connections closed for not logging in within --login-timeout
+    atomic<uint64_t> idle_disconnects; //connections closed after --idle-timeout without input
+    atomic<uint64_t> pings_sent; //pings sent to quiet clients
+    atomic<uint64_t> commands[CMD_KINDS];
+    atomic<uint64_t> messages_sent; //messages written or queued to a client
+    atomic<uint64_t> messages_dropped; //messages dropped by backpressure
+    atomic<uint64_t> slow_disconnects; //clients disconnected by backpressure
+    atomic<uint64_t> offline_stored; //private messages stored for users who were offline
+    atomic<uint64_t> offline_delivered; //stored messages delivered on login
+    Histogram login_ns; //time to check a password and register the client
+    Histogram command_ns; //time to handle one command
+    Histogram fanout; //recipients of a message
+    Histogram queue_depth; //messages in the outbound queue after a message was queued (epoll mode)
+};
+MetricStripe metric_stripes[METRIC_STRIPES];
+atomic<int> next_metric_stripe{0};
+thread_local MetricStripe* thread_metrics = nullptr;
 
-    //checks if group exists
-    auto it = groups.find(group_name);
-    if (it == groups.end()) {
-        string errorMsg = "Error: Group " + group_name + " does not exist!\n";
-        send(sock, errorMsg.c_str(), errorMsg.size(), 0);
-        return;
+//the calling thread's copy of the metrics, the event loops and the first threads each get one of their own
+MetricStripe& metrics() {
+    if (thread_metrics == nullptr) {
+        thread_metrics = &metric_stripes[next_metric_stripe++ % METRIC_STRIPES];
     }
+    return *thread_metrics;
+}
 
-    //remove client as member
-    it->second.erase(sock);
+void count(atomic<uint64_t>& counter, uint64_t n = 1) {
+    counter.fetch_add(n, memory_order_relaxed);
+}
 
-    //delete group if empty otherwise inform client
-    if (it->second.empty()) {
-        groups.erase(it);
-        string deleteMsg = "Group " + group_name + " is now empty and has been deleted.\n";
-        send(sock, deleteMsg.c_str(), deleteMsg.size(), 0);
-    } 
-    
-    else {
-        string successMsg = "You have successfully left the group " + group_name + ".\n";
-        send(sock, successMsg.c_str(), successMsg.size(), 0);
-
-        // Find the username associated with the client socket
-    string username;
-    for (const auto& client : clients) {
-        if (client.second == sock) {
-            username = client.first;
-            break;
+uint64_t now_ns() {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+//what a log record says, the arguments are copied raw and only formatted by the log thread
+enum class LogEvent : uint8_t {
+    Text, //a preformatted line
+    Message, //username, message received from the client
+    Disconnected, //username
+    UserNotFound, //username
+};
+
+//one slot of the log ring, seq tells whose turn it is (Vyukov's bounded MPMC queue, used with a single consumer)
+struct alignas(64) LogRecord {
+    atomic<size_t> seq;
+    LogLevel level;
+    LogEvent event;
+    uint16_t len[2]; //bytes of the two arguments in data
+    timespec time;
+    char data[LOG_RECORD_BYTES];
+};
+
+//lock-free multi producer ring drained by one background thread that writes the formatted records in batches
+struct LogRing {
+    unique_ptr<LogRecord[]> records;
+    alignas(64) atomic<size_t> tail{0}; //next slot a producer claims
+    alignas(64) size_t head = 0; //next slot the log thread reads
+    atomic<size_t> written{0}; //records the log thread has written out
+    atomic<uint64_t> dropped{0}; //records lost because the ring was full
+
+    LogRing() : records(make_unique<LogRecord[]>(LOG_RING_SIZE)) {
+        for (size_t i = 0; i < LOG_RING_SIZE; i++) {
+            records[i].seq.store(i, memory_order_relaxed);
         }
     }
 
-    // Send a group message to all members of the group informing them of who has left
-    string joinMsg = username + " has left the group " + group_name + ".\n";
-    for (const auto& memberSock : it->second) {
-        if (memberSock != sock) { // Skip sending the message to the leaving client
-            send(memberSock, joinMsg.c_str(), joinMsg.size(), 0);
+    //claim a slot and copy the arguments, never blocks: a full ring drops the record
+    void push(LogLevel level, LogEvent event, string_view a, string_view b) {
+        size_t pos = tail.load(memory_order_relaxed);
+        LogRecord* r;
+        while (true) {
+            r = &records[pos & (LOG_RING_SIZE - 1)];
+            intptr_t diff = (intptr_t)r->seq.load(memory_order_acquire) - (intptr_t)pos;
+            if (diff == 0) {
+                if (tail.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                dropped.fetch_add(1, memory_order_relaxed);
+                return;
+            } else {
+                pos = tail.load(memory_order_relaxed);
+            }
         }
+        r->level = level;
+        r->event = event;
+        clock_gettime(CLOCK_REALTIME_COARSE, &r->time);
+        r->len[0] = (uint16_t)min(a.size(), (size_t)LOG_RECORD_BYTES);
+        r->len[1] = (uint16_t)min(b.size(), (size_t)LOG_RECORD_BYTES - r->len[0]);
+        memcpy(r->data, a.data(), r->len[0]);
+        memcpy(r->data + r->len[0], b.data(), r->len[1]);
+        r->seq.store(pos + 1, memory_order_release);
     }
+};
+LogRing log_ring;
+
+//hot path: level check and a raw copy of the arguments into the ring
+void log_event(LogLevel level, LogEvent event, string_view a = {}, string_view b = {}) {
+    if (level < config.log_level) {
+        return;
     }
+    log_ring.push(level, event, a, b);
 }
 
-//print all connected clients
-void print_clients(int sock){ //takes the socket number to print all connected clients for the client
-    
-    //lock the mutex using std::lock_guard
-    lock_guard<mutex> lock(client_mutex);  
+void log_text(LogLevel level, const string& line) {
+    log_event(level, LogEvent::Text, line);
+}
 
-    //print clients
-    for (const auto& client : clients) {
-            string Name = "- " + client.first + " (Socket: " + to_string(client.second) + ")\n";
-            send(sock, Name.c_str(), Name.size(), 0);
+//append one record as a line of text, debug and info go to stdout, warnings and errors to stderr
+void format_record(const LogRecord& r, string& out) {
+    static const char* levels[] = {"DEBUG", "INFO", "WARN", "ERROR"};
+    tm local;
+    localtime_r(&r.time.tv_sec, &local);
+    char stamp[32];
+    size_t n = strftime(stamp, sizeof(stamp), "%H:%M:%S", &local);
+    snprintf(stamp + n, sizeof(stamp) - n, ".%03ld ", r.time.tv_nsec / 1000000);
+    out += stamp;
+    out += levels[(int)r.level];
+    out += ' ';
+    string_view a(r.data, r.len[0]);
+    string_view b(r.data + r.len[0], r.len[1]);
+    switch (r.event) {
+    case LogEvent::Text:
+        out += a;
+        break;
+    case LogEvent::Message:
+        //the text protocol hands over the client's line ending too
+        while (!b.empty() && (b.back() == '\n' || b.back() == '\r')) {
+            b.remove_suffix(1);
         }
+        out += a;
+        out += ':';
+        out += b;
+        break;
+    case LogEvent::Disconnected:
+        out += "Client ";
+        out += a;
+        out += " disconnected.";
+        break;
+    case LogEvent::UserNotFound:
+        out += "User ";
+        out += a;
+        out += " not found!";
+        break;
     }
+    out += '\n';
+}
 
-//print all active groups
-void print_groups(int sock) { //takes the socket number to print all active groups for the client
-
-    //lock the mutex using std::lock_guard
-    lock_guard<mutex> lock(client_mutex);  
+void write_all(int fd, const string& text) {
+    for (size_t done = 0; done < text.size();) {
+        ssize_t n = write(fd, text.data() + done, text.size() - done);
+        if (n <= 0) {
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        done += n;
+    }
+}
 
-    //check if no groups are available
-    if (groups.empty()) {
-        string noGroupsMsg = "Error: No groups available.\n";
-        send(sock, noGroupsMsg.c_str(), noGroupsMsg.size(), 0);
-    } 
-    
-    //print groups
-    else {
-        for (const auto& group : groups) {
-            string groupName = "- " + group.first + "\n";
-            send(sock, groupName.c_str(), groupName.size(), 0);
-
-            // Print group members
-            for (const auto& clientSocket : group.second) {
-                // Find the username associated with the client socket
-                string username;
-                for (const auto& client : clients) {
-                    if (client.second == clientSocket) {
-                        username = client.first;
-                        break;
-                    }
-                }
-                string memberInfo = "  * " + username + " (Socket: " + to_string(clientSocket) + ")\n";
-                send(sock, memberInfo.c_str(), memberInfo.size(), 0);
+//the log thread: format everything published so far, write it with one call per stream, sleep briefly when idle
+void drain_log() {
+    string out, err;
+    uint64_t reportedDrops = 0;
+    while (true) {
+        size_t batch = 0;
+        while (batch < LOG_RING_SIZE) {
+            LogRecord& r = log_ring.records[log_ring.head & (LOG_RING_SIZE - 1)];
+            if (r.seq.load(memory_order_acquire) != log_ring.head + 1) {
+                break;
             }
+            format_record(r, r.level >= LogLevel::Warn ? err : out);
+            r.seq.store(log_ring.head + LOG_RING_SIZE, memory_order_release);
+            log_ring.head++;
+            batch++;
+        }
+        uint64_t drops = log_ring.dropped.load(memory_order_relaxed);
+        if (drops != reportedDrops) {
+            err += "Warning: " + to_string(drops - reportedDrops) + " log records dropped, the log ring was full\n";
+            reportedDrops = drops;
+        }
+        if (!out.empty()) {
+            write_all(STDOUT_FILENO, out);
+            out.clear();
+        }
+        if (!err.empty()) {
+            write_all(STDERR_FILENO, err);
+            err.clear();
+        }
+        log_ring.written.store(log_ring.head, memory_order_release);
+        if (batch == 0) {
+            this_thread::sleep_for(chrono::milliseconds(2));
         }
     }
 }
 
-//send a message to a group
-void group_message(int sock, const string& group_name, const string& message) { //takes the socket number, group name and message to send message to a group
-        
-        //lock the mutex using std::lock_guard
-        lock_guard<mutex> lock(client_mutex);
-
-        //check if group exists
-        auto it = groups.find(group_name);
-        if (it == groups.end()) {
-            string errorMsg = "Error: Group " + group_name + " does not exist!\n";
-            send(sock, errorMsg.c_str(), errorMsg.size(), 0);
-            return;
+//wait (a second at most) until the log thread has written every record pushed so far, before the process exits
+void flush_log() {
+    size_t pushed = log_ring.tail.load();
+    for (int i = 0; i < 500 && log_ring.written.load(memory_order_acquire) < pushed; i++) {
+        this_thread::sleep_for(chrono::milliseconds(2));
+    }
+}
+
+//data management
+struct Session;
+//hash for maps keyed by name that are looked up with views into the received command, without building a string
+struct NameHash {
+    using is_transparent = void;
+    size_t operator()(string_view name) const {
+        return hash<string_view>{}(name);
+    }
+};
+template <typename T>
+using NameMap = unordered_map<string, T, NameHash, equal_to<>>;
+using NameSet = unordered_set<string, NameHash, equal_to<>>;
+
+//user and group names interned as dense 32-bit ids: the name in a command is hashed once, clients, groups and
+//memberships are looked up by id and the text is only read back to format messages and listings
+//a name keeps its id for the life of the server, only logged in users and created groups are interned
+using Symbol = uint32_t;
+constexpr Symbol NO_SYMBOL = UINT32_MAX;
+struct Group;
+struct SymbolEntry {
+    string name;
+    atomic<Group*> group{nullptr}; //the group of that name since its first /create_group, never freed (see --max-groups)
+};
+struct SymbolTable {
+    //open addressing, a slot holds the upper half of the name's hash and its id + 1 (0 is an empty slot)
+    //a lookup takes no lock: slots are only ever filled, and an index more than half full is copied into one twice
+    //its size, the old one is kept for lookups that are still reading it
+    struct Index {
+        size_t mask;
+        unique_ptr<atomic<uint64_t>[]> slots;
+        unique_ptr<Index> older;
+    };
+    atomic<Index*> index;
+    mutex grow; //held while a name is added
+    atomic<Symbol> count{0}; //ids handed out, changed under grow
+    //the entries by id, a page is never moved or freed so an entry is read without a lock by whoever was given its id
+    atomic<SymbolEntry*> pages[SYMBOL_PAGES] = {};
+
+    SymbolTable() {
+        index.store(new_index(1024, nullptr));
+    }
+
+    static Index* new_index(size_t capacity, unique_ptr<Index> older) {
+        Index* in = new Index{capacity - 1, make_unique<atomic<uint64_t>[]>(capacity), move(older)};
+        for (size_t i = 0; i < capacity; i++) {
+            in->slots[i].store(0, memory_order_relaxed);
         }
+        return in;
+    }
 
-        //get name of sending client
-        string senderName;
-        for (const auto& pair : clients) {
-            if (pair.second == sock) {
-                senderName = pair.first;
-                break;
+    static void place(Index& in, size_t hash, Symbol id) {
+        size_t i = hash & in.mask;
+        while (in.slots[i].load(memory_order_relaxed) != 0) {
+            i = (i + 1) & in.mask;
+        }
+        in.slots[i].store((uint64_t)(hash >> 32) << 32 | (id + 1), memory_order_release);
+    }
+
+    //the id of a name, NO_SYMBOL if it was never interned
+    Symbol find(string_view text) const {
+        size_t hash = std::hash<string_view>{}(text);
+        const Index* in = index.load(memory_order_acquire);
+        for (size_t i = hash & in->mask;; i = (i + 1) & in->mask) {
+            uint64_t slot = in->slots[i].load(memory_order_acquire);
+            if (slot == 0) {
+                return NO_SYMBOL;
             }
+            Symbol id = (Symbol)slot - 1;
+            if (slot >> 32 == hash >> 32 && name(id) == text) {
+                return id;
+            }
+        }
+    }
+
+    //the id of a name, given the next free one the first time, NO_SYMBOL if the table is full
+    Symbol intern(string_view text) {
+        Symbol id = find(text);
+        if (id != NO_SYMBOL) {
+            return id;
+        }
+        lock_guard<mutex> lock(grow);
+        id = find(text);
+        if (id != NO_SYMBOL || count.load() == (Symbol)SYMBOL_PAGE * SYMBOL_PAGES) {
+            return id;
+        }
+        id = count.load();
+        SymbolEntry* page = pages[id / SYMBOL_PAGE].load(memory_order_relaxed);
+        if (page == nullptr) {
+            page = new SymbolEntry[SYMBOL_PAGE];
+            pages[id / SYMBOL_PAGE].store(page, memory_order_release);
         }
-        
-        //send message to all client sockets in group
-        string formattedMsg = "[" + group_name + "] " + senderName + ": " + message + "\n";
-        for (int memberSock : it->second) {
-            if (memberSock != sock) { 
-                send(memberSock, formattedMsg.c_str(), formattedMsg.size(), 0);
+        page[id % SYMBOL_PAGE].name = text;
+        count.store(id + 1, memory_order_release);
+        Index* in = index.load(memory_order_relaxed);
+        if ((size_t)(id + 1) * 2 > in->mask + 1) {
+            Index* bigger = new_index((in->mask + 1) * 2, unique_ptr<Index>(in));
+            for (Symbol old = 0; old < id; old++) {
+                place(*bigger, std::hash<string_view>{}(name(old)), old);
             }
+            index.store(bigger, memory_order_release);
+            in = bigger;
         }
+        place(*in, std::hash<string_view>{}(text), id);
+        return id;
+    }
 
-        //confirm to sending client
-        string successMsg = "Message sent to group " + group_name + ".\n";
-        send(sock, successMsg.c_str(), successMsg.size(), 0);
+    SymbolEntry& entry(Symbol id) const {
+        return pages[id / SYMBOL_PAGE].load(memory_order_acquire)[id % SYMBOL_PAGE];
     }
 
-//private messaging
-void client_message(int sock, const string& name, const string& msg) {//takes the socket number, client name and message to send message to a specific client
+    const string& name(Symbol id) const {
+        return entry(id).name;
+    }
+};
+SymbolTable symbols;
 
-    //lock the mutex using std::lock_guard
-    lock_guard<mutex> lock(client_mutex);
+unordered_map<Symbol, Session*> clients; //unordered map, interned username > client session
+using UserIndex = NameMap<string>;
+atomic<shared_ptr<const UserIndex>>users; //credential index, client username > password, swapped as a whole on reload
+//a group has its own reader/writer lock, so messages to different groups never wait for each other
+//recent messages of a group: their text back to back in a byte ring, and a ring of the positions where they start
+//both are allocated with the group's first message, so idle groups cost nothing
+struct History {
+    unique_ptr<char[]> bytes; //config.history_bytes
+    unique_ptr<uint64_t[]> starts; //config.history_messages, absolute byte position of each message
+    uint64_t written = 0; //bytes ever added
+    uint64_t added = 0; //messages ever added
 
-    //finds the sender name using the socket number
-    string senderName; 
-    for (const auto& pair : clients) { 
-        if (pair.second == sock) {
-            senderName = pair.first;
-            break;
+    void add(string_view msg) {
+        size_t capacity = config.history_bytes;
+        if (config.history_messages == 0 || msg.size() > capacity) {
+            return;
         }
+        if (!bytes) {
+            bytes = make_unique<char[]>(capacity);
+            starts = make_unique<uint64_t[]>(config.history_messages);
+        }
+        size_t at = written % capacity;
+        size_t first = min(msg.size(), capacity - at);
+        memcpy(bytes.get() + at, msg.data(), first);
+        memcpy(bytes.get(), msg.data() + first, msg.size() - first);
+        starts[added % config.history_messages] = written;
+        written += msg.size();
+        added++;
     }
 
-    //finds the reciever socket using the name
-    auto it = clients.find(name); 
-    if (it != clients.end()) { 
-        int destsock = it->second; 
-        string formattedMsg = "[" + senderName + "] " + msg; 
-        send(destsock, formattedMsg.c_str(), formattedMsg.size(), 0); 
-    } else {
-        cout << "User " << name << " not found!" << endl;
-        string errormsg = "Error: User " +name+ " not found!";
-        send(sock, errormsg.c_str(), errormsg.size(), 0);
+    //the oldest of the latest n messages whose text is still held
+    uint64_t first_held(uint64_t n) const {
+        uint64_t first = added - min<uint64_t>({n, added, config.history_messages});
+        while (first < added && starts[first % config.history_messages] + config.history_bytes < written) {
+            first++; //overwritten by newer text
+        }
+        return first;
     }
-}
 
-//broadcast message
-void broadcast_message(int sock, const string& msg) {//takes the socket number and message to broadcast the message to all clients except the sender
+    //append the text from absolute byte position from up to to
+    void copy(uint64_t from, uint64_t to, string& out) const {
+        size_t capacity = config.history_bytes;
+        size_t at = from % capacity;
+        size_t len = to - from;
+        size_t part = min(len, capacity - at);
+        out.append(bytes.get() + at, part);
+        out.append(bytes.get(), len - part);
+    }
 
-    //lock the mutex using std::lock_guard
-    lock_guard<mutex> lock(client_mutex);
+    //the text of up to n of the latest messages still held, oldest first, returns how many
+    size_t last(size_t n, string& out) const {
+        uint64_t first = first_held(n);
+        if (first == added) {
+            return 0;
+        }
+        copy(starts[first % config.history_messages], written, out);
+        return added - first;
+    }
 
-    //finds the sender name using the socket number
-    std::string senderName;
-    for (const auto& pair : clients) {
-        if (pair.second == sock) {
-            senderName = pair.first;
-            break;
+    //call f(text) for every message still held, oldest first
+    template <typename F>
+    void for_each(F f) const {
+        string text;
+        for (uint64_t i = first_held(added); i < added; i++) {
+            text.clear();
+            copy(starts[i % config.history_messages], i + 1 < added ? starts[(i + 1) % config.history_messages] : written, text);
+            f(text);
         }
     }
+};
 
-    //broadcasts the message to all clients except the sender
-    std::string formattedMsg = "[Broadcast from " + senderName + "] " + msg;
+//a set of socket numbers as a bitset: the kernel hands out the lowest free socket number, so they stay small and dense
+//and a set of them is a few words that can be combined a word at a time
+typedef uint64_t WordBlock __attribute__((vector_size(32))); //4 words of a bitset, combined with vector instructions
+struct SocketSet {
+    static constexpr size_t BLOCK = 4; //words come in blocks of 256 bits, combined as one WordBlock
+    vector<uint64_t> words;
 
-    for (const auto& pair : clients) {
-        if (pair.second != sock) { 
-            send(pair.second, formattedMsg.c_str(), formattedMsg.size(), 0);
+    void insert(int sock) {
+        size_t w = (size_t)sock >> 6;
+        if (w >= words.size()) {
+            words.resize((w / BLOCK + 1) * BLOCK);
         }
+        words[w] |= 1ull << (sock & 63);
     }
 
-}
+    void erase(int sock) {
+        size_t w = (size_t)sock >> 6;
+        if (w < words.size()) {
+            words[w] &= ~(1ull << (sock & 63));
+        }
+    }
 
-//process the message sent by the client
-void process_message(const string& message, int client_socket, bool& logout_flag){ //takes the message and client socket to process the message depending on the command
+    bool contains(int sock) const {
+        size_t w = (size_t)sock >> 6;
+        return w < words.size() && (words[w] >> (sock & 63) & 1);
+    }
 
-    if (message.rfind("/msg", 0) == 0){ //check if the message is a private message
-        size_t space1 = message.find(' ');
-        size_t space2 = message.find(' ', space1 + 1);
-        if (space1 != string::npos && space2 != string::npos) {
-            std::string client_name = message.substr(space1 + 1, space2 - space1 - 1); // Extract the client name
-            std::string client_msg = message.substr(space2 + 1); // Extract the message after the client name
-            
-            // Call function to handle private messaging
-            client_message(client_socket, client_name, client_msg); 
+    //call f(sock) for every member, in socket order
+    template <typename F>
+    void for_each(F f) const {
+        for (size_t w = 0; w < words.size(); w++) {
+            for (uint64_t bits = words[w]; bits != 0; bits &= bits - 1) {
+                f((int)(w * 64 + countr_zero(bits)));
+            }
         }
     }
-   
-    else if (message.rfind("/broadcast", 0) == 0){ //check if the message is a broadcast message
-        size_t space = message.find(' ');
-        if (space != string::npos) {
-        string broadcast_msg = message.substr(space + 1); // Extract the message after the command
+};
+
+//a connection: its socket number, dense because the kernel hands out the lowest free one, and the epoch of the
+//socket's slot, bumped when the socket is closed, so a connection that reused the number is never mistaken for it
+struct Recipient {
+    int sock;
+    uint32_t epoch;
+};
+
+//a member of a group, the connection is copied straight into the recipients of a group message
+struct Member {
+    Recipient conn;
+    Session* session;
+};
+
+struct Group {
+    shared_mutex lock;
+    vector<Member> members; //sorted by socket, collecting the recipients of a message is a scan of one array
+    SocketSet member_socks; //the members' sockets, for combining groups when one message goes to several
+    bool deleted = true; //no members: the group is not created yet, or its last member left
+    mutex history_lock; //group messages are sent under the shared group lock, so the history has its own
+    History history;
+
+    //under the exclusive lock
+    void add(Session* session);
+    void remove(Session* session);
+    void retire(); //the last member left: mark the group deleted and drop its history
+};
+//Mutex for thread-safe access to clients, shared for lookups and exclusive for login/logout
+shared_mutex client_mutex;
+SocketSet online_socks; //sockets of the logged in clients, under client_mutex like clients
+
+//a rendered /active or /grps listing, shared by every client asking for it until the clients or groups change
+struct Listing {
+    uint64_t version; //clients_version or groups_version it was rendered at
+    string text;
+    vector<size_t> starts; //where every entry (a user, or a group with its members) starts, and the end of the text
+};
+//bumped after every change that shows in a listing, so a cached listing rendered before it is not used again
+atomic<uint64_t> clients_version{0};
+atomic<uint64_t> groups_version{0};
+atomic<shared_ptr<const Listing>> clients_listing;
+atomic<shared_ptr<const Listing>> groups_listing;
+
+atomic<int> group_count{0}; //groups ever created, they are never freed
+
+//count one more group against --max-groups, false if the server holds as many as it may
+bool reserve_group() {
+    if (group_count.fetch_add(1) >= config.max_groups && config.max_groups > 0) {
+        group_count--;
+        return false;
+    }
+    return true;
+}
+
+//look up a group without a lock, nullptr if none of that name was ever created (check Group::deleted under its lock)
+//a group is kept in its name's symbol entry once created, a deleted group is brought back by the next /create_group
+Group* find_group(Symbol group_id) {
+    return group_id == NO_SYMBOL ? nullptr : symbols.entry(group_id).group.load(memory_order_acquire);
+}
+
+//frame opcodes of the framed protocol
+enum Opcode : uint8_t {
+    OP_TEXT = 1, //a login answer or command from the client, or output for the client
+};
 
-        // Call function to handle broadcasting
-        broadcast_message(client_socket, broadcast_msg);
+//write value as a varint (7 bits per byte, least significant group first), returns the number of bytes written
+size_t put_varint(uint8_t* out, uint64_t value) {
+    size_t n = 0;
+    do {
+        uint8_t byte = value & 0x7f;
+        value >>= 7;
+        out[n++] = byte | (value ? 0x80 : 0);
+    } while (value);
+    return n;
+}
+
+//read a varint, returns the number of bytes used, 0 if more bytes are needed, -1 if it is malformed
+int get_varint(const char* p, size_t n, uint64_t& value) {
+    value = 0;
+    for (size_t i = 0; i < n && i < 10; i++) {
+        uint8_t byte = p[i];
+        value |= uint64_t(byte & 0x7f) << (7 * i);
+        if (!(byte & 0x80)) {
+            return i + 1;
         }
     }
-    
-    else if (message.rfind("/create_group", 0) == 0){//check if the message is to create a group
-        size_t space = message.find(' ');
-        if (space != string::npos) {
-        string group_name = message.substr(space + 1); // Extract the group name
+    return n >= 10 ? -1 : 0;
+}
+
+//growable receive buffer, bytes are received straight into its tail and frames are parsed in place
+struct InputBuffer {
+    unique_ptr<char[]> data;
+    size_t capacity = 0;
+    size_t start = 0; //first unparsed byte
+    size_t end = 0; //one past the last received byte
 
-        // Call function to create a group
-        create_group(client_socket, group_name); 
+    //make room for at least want more bytes and return where they go
+    char* tail(size_t want) {
+        if (end + want > capacity) {
+            size_t used = end - start;
+            if (used + want > capacity) {
+                size_t grown = max(capacity * 2, used + want);
+                unique_ptr<char[]> bigger(new char[grown]);
+                memcpy(bigger.get(), data.get() + start, used);
+                data = move(bigger);
+                capacity = grown;
+            } else {
+                memmove(data.get(), data.get() + start, used);
+            }
+            start = 0;
+            end = used;
         }
+        return data.get() + end;
+    }
+
+    void commit(size_t n) {
+        end += n;
     }
 
-    else if (message.rfind("/join_group", 0) == 0) {//check if the message is to join a group
-        size_t space = message.find(' ');
-        if (space != string::npos) {
-        string group_name = message.substr(space + 1); // Extract the group name
-        
-        // Call function to join a group
-        join_group(client_socket, group_name); 
+    string_view pending() const {
+        return string_view(data.get() + start, end - start);
+    }
+
+    //drop parsed bytes, and give back the memory of an oversized buffer once it is empty
+    void consume(size_t n) {
+        start += n;
+        if (start == end) {
+            start = end = 0;
+            if (capacity > 4 * READ_CHUNK) {
+                data.reset();
+                capacity = 0;
+            }
         }
-    }   
+    }
+};
 
-    else if (message.rfind("/leave_group", 0) == 0) { //check if the message is to leave a group
-        size_t space = message.find(' ');
-        if (space != string::npos) {
-        string group_name = message.substr(space + 1); // Extract the group name    
+//frame header of a message in framed mode, empty in text mode
+size_t frame_header(uint8_t* header, size_t msgLen) {
+    if (config.protocol == Protocol::Text) {
+        return 0;
+    }
+    size_t headerLen = put_varint(header, msgLen + 1);
+    header[headerLen++] = OP_TEXT;
+    return headerLen;
+}
+
+//message buffers come from per-thread pools of free blocks in a few size classes, a block freed by another thread
+//goes back to the pool of the thread that allocated it, so formatting messages does not touch the heap once warm
+struct MsgPool;
+struct PoolBlock {
+    MsgPool* pool; //pool the block is returned to
+    size_t cls; //size class, MSG_POOL_CLASSES for a block too large for the pool
+    PoolBlock* next = nullptr; //free list link
+};
+
+struct MsgPool {
+    vector<PoolBlock*> free[MSG_POOL_CLASSES]; //blocks ready for reuse, only touched by the owning thread
+    atomic<PoolBlock*> returned{nullptr}; //blocks freed by other threads, taken over as a whole by the owning thread
+    atomic<size_t> refs{1}; //the owning thread plus one per block in use, the pool goes away with the last of them
 
-        // Call function to leave a group
-        leave_group(client_socket, group_name);
+    static size_t capacity(size_t cls) {
+        return (size_t)128 << (2 * cls); //128 bytes up to 8 KiB with 4 classes
+    }
+
+    void release() {
+        if (refs.fetch_sub(1, memory_order_acq_rel) == 1) {
+            delete this;
         }
     }
 
-    else if (message.rfind("/group_msg", 0) == 0){   //check if the message is a group message
-        size_t space1 = message.find(' ');
-        size_t space2 = message.find(' ', space1 + 1);
-        if (space1 != string::npos && space2 != string::npos) {
-            string group_name = message.substr(space1 + 1, space2 - space1 - 1);  // Extract the group name      
-            string group_msg = message.substr(space2 + 1); // Extract the message after the group name
-            
-            // Check if the client socket is part of the group
-            auto group_it = groups.find(group_name);
-            if (group_it != groups.end() && group_it->second.find(client_socket) != group_it->second.end()) {
-                // Call function to handle group messaging
-                group_message(client_socket, group_name, group_msg);
-            } else {
-                string errorMsg = "Error: You are not a member of the group " + group_name + ".\n";
-                send(client_socket, errorMsg.c_str(), errorMsg.size(), 0);
+    ~MsgPool() {
+        for (auto& list : free) {
+            for (PoolBlock* block : list) {
+                ::operator delete(block);
             }
         }
+        for (PoolBlock* block = returned.load(); block != nullptr;) {
+            PoolBlock* next = block->next;
+            ::operator delete(block);
+            block = next;
+        }
     }
+};
 
-    else if (message.rfind("/grps", 0) == 0){ //check if the message is to print all groups
+//the calling thread's pool, handed over to its blocks when the thread exits
+struct PoolOwner {
+    MsgPool* pool = new MsgPool();
+    ~PoolOwner() {
+        pool->release();
+    }
+};
+thread_local PoolOwner pool_owner;
 
-        // Call function to print all groups
-        print_groups(client_socket);
+void* pool_alloc(size_t bytes) {
+    MsgPool* pool = pool_owner.pool;
+    size_t cls = 0;
+    while (cls < MSG_POOL_CLASSES && MsgPool::capacity(cls) < bytes) {
+        cls++;
+    }
+    PoolBlock* block = nullptr;
+    if (cls < MSG_POOL_CLASSES) {
+        auto& list = pool->free[cls];
+        if (list.empty()) {
+            //take back what other threads released, blocks of other classes land on their own lists
+            for (PoolBlock* b = pool->returned.exchange(nullptr, memory_order_acquire); b != nullptr;) {
+                PoolBlock* next = b->next;
+                if (pool->free[b->cls].size() < MSG_POOL_DEPTH) {
+                    pool->free[b->cls].push_back(b);
+                } else {
+                    ::operator delete(b);
+                }
+                b = next;
+            }
+        }
+        if (!list.empty()) {
+            block = list.back();
+            list.pop_back();
+        }
     }
+    if (block == nullptr) {
+        block = (PoolBlock*)::operator new(sizeof(PoolBlock) + (cls < MSG_POOL_CLASSES ? MsgPool::capacity(cls) : bytes));
+        block->cls = cls;
+    }
+    block->pool = pool;
+    pool->refs.fetch_add(1, memory_order_relaxed);
+    return block + 1;
+}
 
-    else if (message.rfind("/active", 0) == 0){ //check if the message is to print all active clients
+void pool_free(void* p) {
+    PoolBlock* block = (PoolBlock*)p - 1;
+    MsgPool* pool = block->pool;
+    if (block->cls == MSG_POOL_CLASSES) {
+        ::operator delete(block);
+    } else if (pool == pool_owner.pool) {
+        if (pool->free[block->cls].size() < MSG_POOL_DEPTH) {
+            pool->free[block->cls].push_back(block);
+        } else {
+            ::operator delete(block);
+        }
+    } else {
+        block->next = pool->returned.load(memory_order_relaxed);
+        while (!pool->returned.compare_exchange_weak(block->next, block, memory_order_release, memory_order_relaxed)) {
+        }
+    }
+    pool->release();
+}
 
-        // Call function to print all active clients
-        print_clients(client_socket);
+//allocator for allocate_shared, the control block and the message bytes share one pool block
+template <typename T>
+struct PoolAllocator {
+    using value_type = T;
+    PoolAllocator() = default;
+    template <typename U>
+    PoolAllocator(const PoolAllocator<U>&) {}
+    T* allocate(size_t n) {
+        return (T*)pool_alloc(n * sizeof(T));
+    }
+    void deallocate(T* p, size_t) {
+        pool_free(p);
+    }
+    template <typename U>
+    bool operator==(const PoolAllocator<U>&) const {
+        return true;
     }
+};
 
-    else if (message.rfind("/logout", 0) == 0){ //check if the message is to logout
-        logout_flag = true;
+//message bytes, left uninitialized until the parts are copied in
+template <size_t N>
+struct MsgBlock {
+    MsgBlock() {}
+    char data[N];
+};
+
+//immutable reference counted message, formatted once and queued by reference for every recipient
+struct MsgBuf {
+    shared_ptr<const void> owner; //keeps the bytes alive
+    const char* data = nullptr;
+    size_t size = 0;
+};
+
+template <size_t N>
+MsgBuf pooled_msg(initializer_list<string_view> parts, size_t size) {
+    auto block = allocate_shared<MsgBlock<N>>(PoolAllocator<MsgBlock<N>>());
+    char* at = block->data;
+    for (string_view part : parts) {
+        if (!part.empty()) {
+            memcpy(at, part.data(), part.size());
+            at += part.size();
+        }
     }
+    return {block, block->data, size};
 }
 
-//Define a function to handle each client by assigning each of them a thread for communication
-void clientHandler(int clientSocket) {
-    char username[BUFFER_SIZE], password[BUFFER_SIZE]; //define buffers to store the username and password entered by the user
-    string receivedUsername, receivedPassword; //define strings to store the username and password entered by the user
-    int bytesReceived; //define a variable to store the number of bytes received from the client
-    int loginAttempts = 0; // Track the number of login attempts
-
-    while (loginAttempts < 3) { // Allow up to 3 login attempts
-        // Ask the client for username
-        const char* message1 = "Welcome to Wazzapp\n\nEnter the username: ";
-        send(clientSocket, message1, strlen(message1), 0);
-        memset(username, 0, BUFFER_SIZE);  // Clear the buffer to avoid old data
-        bytesReceived = recv(clientSocket, username, BUFFER_SIZE, 0);   // Receive the username from the client
-
-        if (bytesReceived <= 0) { // Check if the client has disconnected
-            close(clientSocket);
-            return;
+//format a message from its parts straight into a pooled block, the control block takes up to 32 bytes of it
+MsgBuf make_msg(initializer_list<string_view> parts) {
+    size_t size = 0;
+    for (string_view part : parts) {
+        size += part.size();
+    }
+    if (size <= 96) {
+        return pooled_msg<96>(parts, size);
+    } else if (size <= 480) {
+        return pooled_msg<480>(parts, size);
+    } else if (size <= 2016) {
+        return pooled_msg<2016>(parts, size);
+    } else if (size <= 8160) {
+        return pooled_msg<8160>(parts, size);
+    }
+    string text;
+    text.reserve(size);
+    for (string_view part : parts) {
+        text.append(part);
+    }
+    auto owner = make_shared<const string>(move(text));
+    return {owner, owner->data(), owner->size()};
+}
+
+MsgBuf make_msg(string_view text) {
+    return make_msg({text});
+}
+
+//one message waiting in an outbound queue
+struct OutEntry {
+    MsgBuf body; //shared with the queues of the other recipients
+    uint8_t header[11]; //frame header in framed mode
+    uint8_t headerLen = 0;
+    size_t sent = 0; //bytes of header and body already written
+    size_t messages = 1; //messages in body, more than one once merged by coalesce
+
+    size_t size() const {
+        return headerLen + body.size;
+    }
+};
+
+//bounded ring of output waiting for a client's socket, only touched by the owning event loop
+struct OutboundQueue {
+    unique_ptr<OutEntry[]> ring; //allocated on first use, config.queue_slots entries
+    size_t head = 0; //oldest entry
+    size_t count = 0;
+    size_t bytes = 0; //unsent bytes in the queue
+    uint64_t dropped = 0; //messages lost to backpressure
+
+    OutEntry& at(size_t i) {
+        return ring[(head + i) % config.queue_slots];
+    }
+
+    bool fits(size_t len) const {
+        return count < config.queue_slots && bytes + len <= config.queue_bytes;
+    }
+
+    void push(const MsgBuf& msg) {
+        if (!ring) {
+            ring = make_unique<OutEntry[]>(config.queue_slots);
         }
-        username[bytesReceived] = '\0'; // Null-terminate
-        receivedUsername = username;  // Store the received username
+        OutEntry& e = at(count++);
+        e.body = msg;
+        e.headerLen = frame_header(e.header, msg.size);
+        e.sent = 0;
+        e.messages = 1;
+        bytes += e.size();
+    }
 
-        // Check if the username is already in use by another client and send a message to the client
-        if (clients.find(receivedUsername) != clients.end()) {
-            const char* messageFail = "Error: Client already connected! Log out from previous session to connect.\n";
-            send(clientSocket, messageFail, strlen(messageFail), 0);
-            continue; // Continue listening to messages from the client without termination
+    //output that carries its frame headers already, the unsent output handed over by a hot restart
+    void push_raw(const MsgBuf& data) {
+        push(data);
+        OutEntry& e = at(count - 1);
+        bytes -= e.headerLen;
+        e.headerLen = 0;
+    }
+
+    void pop() {
+        OutEntry& e = at(0);
+        bytes -= e.size() - e.sent;
+        e.body = MsgBuf();
+        head = (head + 1) % config.queue_slots;
+        count--;
+    }
+
+    //account for n bytes written by the socket
+    void consume(size_t n) {
+        while (n > 0) {
+            OutEntry& e = at(0);
+            size_t left = e.size() - e.sent;
+            if (n < left) {
+                e.sent += n;
+                bytes -= n;
+                return;
+            }
+            n -= left;
+            pop();
         }
+    }
 
-        // Ask the client for password
-        const char* message2 = "Enter the password: ";
-        send(clientSocket, message2, strlen(message2), 0);
-        // Receive the password from the client
-        memset(password, 0, BUFFER_SIZE);  // Clear the buffer to avoid old data
-        bytesReceived = recv(clientSocket, password, BUFFER_SIZE, 0);  // Receive password from the client
-        if (bytesReceived <= 0) { // Check if the client has disconnected
-            close(clientSocket);
+    //make room for msg: the oldest messages not started yet are dropped until it fits the byte budget,
+    //and the rest of them are merged into one entry when the queue is out of slots
+    void coalesce(const MsgBuf& msg) {
+        size_t first = (count > 0 && at(0).sent > 0) ? 1 : 0; //a half written message stays as it is
+        uint8_t header[11];
+        size_t len = frame_header(header, msg.size) + msg.size;
+        while (bytes + len > config.queue_bytes && count > first) {
+            if (first) {
+                swap(at(0), at(1)); //keep the half written message at the front
+            }
+            dropped += at(0).messages;
+            pop();
+        }
+        if (bytes + len > config.queue_bytes) {
+            dropped++;
             return;
         }
-        password[bytesReceived] = '\0'; // Null-terminate
-        receivedPassword = password;  // Store the received password
-
-        // Check the users file for authentication
-        string struser = receivedUsername + ":" + receivedPassword;
-        ifstream in("users.txt");
-        string strfile;
-        bool authenticated = false;
-        while (getline(in, strfile)) { // Check if the username and password match
-            // Lock the mutex using std::lock_guard
-            lock_guard<mutex> lock(client_mutex);
-
-            if (strfile == struser) {
-                // Send the welcome message to the client
-                const char* messagever = "Welcome to the chat server!\n\nTo broadcast the message to all online users type /broadcast <message>\nTo send message to a specific online client type /msg <username> <message>\nTo send message to a specific group type /group_msg <group_name> <message>\nTo create a new group type /create group <group name>\nTo join an existing group type /join group <group name>\nTo leave a group type /leave group <group name>\nTo get a list of all active users type /active\nTo get a list of all groups type /grps\n\nTo log out type /logout\n\nType /exit for closing the session\n\nEnjoy your time here!\n ";
-
-                // Add the client to the map of clients
-                clients[receivedUsername] = clientSocket;
-                send(clientSocket, messagever, strlen(messagever), 0);
-                authenticated = true;
-                break;
+
+        if (count == config.queue_slots && count > first) {
+            //frame headers become part of the merged body, so the merged entry has none of its own
+            string merged;
+            size_t messages = 0;
+            for (size_t i = first; i < count; i++) {
+                OutEntry& e = at(i);
+                merged.append((const char*)e.header, e.headerLen);
+                merged.append(e.body.data, e.body.size);
+                messages += e.messages;
+            }
+            while (count > first) {
+                OutEntry& e = at(--count);
+                bytes -= e.size();
+                e.body = MsgBuf();
             }
+            OutEntry& e = at(count++);
+            e.body = make_msg(merged);
+            e.headerLen = 0;
+            e.sent = 0;
+            e.messages = messages;
+            bytes += e.size();
         }
-        if (!authenticated) {
-            const char* messageFail = "Error: Wrong credentials! You have 3 total login attempts\n\n"; // Send a message to the client if authentication fails
-            send(clientSocket, messageFail, strlen(messageFail), 0);
-            loginAttempts++; // Increment the login attempts counter
-            continue;
-        } else {
-            break;
+        if (count == config.queue_slots) {
+            dropped++;
+            return;
         }
+        push(msg);
     }
+};
 
-    if (loginAttempts >= 3) {
-        const char* messageFail = "Error: Too many failed login attempts. Authentication failed.\n";
-        send(clientSocket, messageFail, strlen(messageFail), 0);
-        close(clientSocket);
-        return;
+//output handed to an io_uring send: it is taken off the outbound queue, so backpressure never moves or frees what the kernel reads
+struct SendBatch {
+    static constexpr int ENTRIES = 32;
+    iovec iov[2 * ENTRIES];
+    uint8_t headers[ENTRIES][11];
+    MsgBuf bodies[ENTRIES]; //keep the messages alive until the kernel is done with them
+    msghdr mh{};
+    int entries = 0;
+};
+
+//a message handed to an event loop for one of its sockets, or for all of its logged in clients (sock -1)
+struct Delivery {
+    Recipient to;
+    MsgBuf msg;
+    int except = -1; //sock -1: the sender, who does not get its own broadcast
+};
+
+//login state of a connection
+enum class LoginState { AwaitUsername, AwaitPassword, Verifying, LoggedIn };
+
+struct EventLoop;
+
+//refilled lazily: the tokens earned since the last command are added when the next one comes in
+struct TokenBucket {
+    double tokens = 0;
+    uint64_t last = 0; //now_ns() of the last refill, 0 before the first command
+
+    //refill, true if a token is available
+    bool refill(const RateLimit& limit, uint64_t now) {
+        if (limit.rate <= 0) {
+            return true;
+        }
+        tokens = last == 0 ? limit.burst : min(limit.burst, tokens + (now - last) * 1e-9 * limit.rate);
+        last = now;
+        return tokens >= 1;
     }
+};
 
-    bool logout_flag = false; //create a flag to check if the client has logged out
-    while (!logout_flag) { //break out of this loop if the client logs out
-        //Continue listening to messages from client without termination
-        char buffer[BUFFER_SIZE]; //create a buffer for incoming messages from the client
-        memset(buffer, 0, BUFFER_SIZE); //clear the buffer before receiving new data
-        int bytesReceived = recv(clientSocket, buffer, BUFFER_SIZE, 0); //store the number of bytes(packets) of messages sent from the client
-        //Check if the client has disconnected
-        if (bytesReceived <= 0) {
-            cout << "Client " << receivedUsername << " disconnected.\n" << endl;
-            break;
+//entry of a timer wheel, an intrusive list node so that scheduling and cancelling never allocate
+struct TimerNode {
+    TimerNode* prev = nullptr;
+    TimerNode* next = nullptr; //nullptr while not scheduled
+    uint64_t expires = 0; //tick at which the timer goes off
+    Session* session = nullptr;
+};
+
+//hierarchical timing wheel: level 0 has a slot per tick for the next 64 ticks, each level above a slot per 64 slots of the
+//level below, a timer far away sits in a coarse slot and moves down a level whenever the level below wraps around to it
+//scheduling and cancelling are O(1), a tick costs one slot of expired timers plus the odd cascade
+struct TimerWheel {
+    static constexpr uint64_t SLOTS = 1 << TIMER_SLOT_BITS;
+    TimerNode slots[TIMER_LEVELS][SLOTS]; //list heads, circular
+    uint64_t current = 0; //last tick that was run
+    size_t size = 0; //scheduled timers
+
+    TimerWheel() {
+        for (auto& level : slots) {
+            for (TimerNode& head : level) {
+                head.prev = head.next = &head;
+            }
         }
-        //Display any message sent by the client
-        cout << receivedUsername << ":" << buffer << endl;
-        //Pass the message into the process_message
-        process_message(buffer, clientSocket, logout_flag);
-        if (bytesReceived <= 0) {
-            close(clientSocket); //close the client socket if the client has disconnected
-            return;
+        current = now_ns() / (TIMER_TICK_MS * 1000000ull);
+    }
+
+    //link a timer into the slot for its tick, relative to the current one
+    void place(TimerNode& node) {
+        uint64_t delta = node.expires - current;
+        int level = 0;
+        while (level + 1 < TIMER_LEVELS && delta >= (1ull << (TIMER_SLOT_BITS * (level + 1)))) {
+            level++;
         }
-        //Remove the client from the map if client has disconnected and close the client socket
+        TimerNode& head = slots[level][(node.expires >> (TIMER_SLOT_BITS * level)) & (SLOTS - 1)];
+        node.prev = head.prev;
+        node.next = &head;
+        head.prev->next = &node;
+        head.prev = &node;
     }
-    {   //lock the mutex using std::lock_guard
-        lock_guard<mutex> lock(client_mutex);
 
-        //remove client from clients
-        for (auto it = clients.begin(); it != clients.end(); ++it) {
-            if (it->second == clientSocket) {
-                clients.erase(it->first);
-                break;
-            }
+    //(re)schedule a timer to go off at deadline (now_ns() time), at the first tick after it
+    void schedule(TimerNode& node, uint64_t deadline) {
+        cancel(node);
+        uint64_t tick = (deadline + TIMER_TICK_MS * 1000000ull - 1) / (TIMER_TICK_MS * 1000000ull);
+        uint64_t horizon = current + (1ull << (TIMER_SLOT_BITS * TIMER_LEVELS)) - 1;
+        node.expires = min(max(tick, current + 1), horizon); //a timer beyond the horizon goes off early and is scheduled again
+        place(node);
+        size++;
+    }
+
+    void cancel(TimerNode& node) {
+        if (node.next == nullptr) {
+            return;
         }
+        node.prev->next = node.next;
+        node.next->prev = node.prev;
+        node.prev = node.next = nullptr;
+        size--;
+    }
 
-        //remove client from groups
-        for (auto& group : groups) {
-            if (group.second.find(clientSocket) != group.second.end()) {
-                leave_group(clientSocket, group.first);
+    //run the ticks up to now, expire(node) is called for every timer that went off, after it was unlinked
+    template <typename Expire>
+    void advance(uint64_t now, Expire expire) {
+        uint64_t target = now / (TIMER_TICK_MS * 1000000ull);
+        if (size == 0) {
+            current = max(current, target);
+            return;
+        }
+        while (current < target && size > 0) {
+            current++;
+            //a level that wraps around empties the matching slot of the level above into the levels below
+            for (int level = 1; level < TIMER_LEVELS && (current & ((1ull << (TIMER_SLOT_BITS * level)) - 1)) == 0; level++) {
+                TimerNode& head = slots[level][(current >> (TIMER_SLOT_BITS * level)) & (SLOTS - 1)];
+                while (head.next != &head) {
+                    TimerNode& node = *head.next;
+                    head.next = node.next;
+                    node.next->prev = &head;
+                    place(node);
+                }
+            }
+            TimerNode& head = slots[0][current & (SLOTS - 1)];
+            while (head.next != &head) {
+                TimerNode& node = *head.next;
+                cancel(node);
+                expire(node);
             }
         }
+        current = max(current, target);
     }
-    clientHandler(clientSocket);
-}
 
-int main()
-{   //create server socket to listen to clients
-    int server_socket;
-    server_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_socket == -1){
-        cerr <<"Error: Can not create socket\n" << endl;
-        return 1;
+    //milliseconds until the next tick, for epoll_wait, -1 (wait forever) when nothing is scheduled
+    int wait_ms(uint64_t now) const {
+        if (size == 0) {
+            return -1;
+        }
+        uint64_t next = (current + 1) * TIMER_TICK_MS * 1000000ull;
+        return next <= now ? 0 : (int)((next - now + 999999) / 1000000);
     }
+};
 
-    //define server socket address using ip and port
-    sockaddr_in serv_sock_addr{};
-    serv_sock_addr.sin_family = AF_INET;
-    serv_sock_addr.sin_port = htons(PORT);
-    inet_pton(AF_INET, "0.0.0.0", &serv_sock_addr.sin_addr);
+//per-connection session, shared by the thread-per-client mode and the epoll mode
+struct Session {
+    int sock;
+    uint32_t epoch = 0; //epoch of the socket's slot while the connection is open, {sock, epoch} identifies the connection
+    EventLoop* loop = nullptr; //owning event loop, nullptr in thread mode
+    atomic<LoginState> state{LoginState::AwaitUsername}; //changed by the client's thread or strand, read by the event loop for broadcasts
+    int loginAttempts = 0; //failed attempts since the connection (or the last logout)
+    TokenBucket buckets[CMD_KINDS + 1]; //rate limits by command kind and for all commands, only used by the client's own thread or strand
+    string username; //username being logged in, or the logged in username
+    Symbol user = NO_SYMBOL; //the interned username once logged in
+    vector<Symbol> groups; //sorted ids of the groups the client is a member of, only changed by the client's own thread or loop
+    InputBuffer input; //received bytes not parsed into frames yet (framed protocol)
+    size_t frame_missing = 0; //bytes still missing from the frame at the front of input
+    OutboundQueue out; //output not written yet (epoll mode)
+    deque<pair<uint32_t, MsgBuf>> zerocopy_pending; //messages handed to the kernel with MSG_ZEROCOPY, by send id, until it is done with them
+    uint32_t zerocopy_next = 0; //id the kernel gives the next MSG_ZEROCOPY send
+    bool dirty = false; //queued on the loop's list of sessions to flush
+    bool closing = false; //queued on the loop's list of sessions to close
+    //with workers the session is a strand: its input is handled in order, by one worker at a time
+    mutex strand_mutex; //protects strand_input, strand_scheduled and strand_closed
+    string strand_input; //received messages not handled yet, each as a 4 byte length followed by the message
+    bool strand_scheduled = false; //queued on a worker or being run
+    bool strand_closed = false; //the connection is gone, the client is logged out and closed after its last input
+    bool strand_failed = false; //handle_input asked for a close, the rest of the input is ignored (strand only)
+    //login, idle and ping timer, on the owning loop's wheel (epoll mode) or the timer thread's (thread mode)
+    TimerNode timer;
+    atomic<uint64_t> last_active{0}; //now_ns() of the last input, stored on every receive, only read when the timer goes off
+    atomic<uint64_t> login_started{0}; //now_ns() when the connection started waiting for a login, on connect and logout
+    uint64_t pinged = 0; //now_ns() of the last ping, only used by the timer
+    uint64_t verify_started = 0; //now_ns() when the password went to the verifier
+    string held_input; //input received while the password is checked, each as a 4 byte length followed by the message
+    //io_uring backend: the session is freed only once neither its multishot receive nor a send is left in the kernel
+    bool recv_armed = false;
+    bool sending = false;
+    bool draining = false; //shut down, waiting for its last completions
+    unique_ptr<SendBatch> batch; //allocated with the first send, the rest of a send cut short by a handoff stays in it
+    pthread_t thread{}; //thread mode: the client's thread, interrupted with SIGUSR1 when a hot restart stops the clients
 
-    //bind the socket to ip and port
-    if(bind(server_socket, (sockaddr*)&serv_sock_addr, sizeof(serv_sock_addr)) == -1){
-        cerr << "Error: Can not bind to IP/Port\n" <<endl;
-        return 2;
+    bool member_of(Symbol group) const {
+        return binary_search(groups.begin(), groups.end(), group);
     }
-    //start listening on the socket
-    if (listen(server_socket, SOMAXCONN) == -1){
-        cerr << "Error: Can't listen via socket\n" <<endl;
-        return 3;
+    void join(Symbol group) {
+        auto it = lower_bound(groups.begin(), groups.end(), group);
+        if (it == groups.end() || *it != group) {
+            groups.insert(it, group);
+        }
+    }
+    void leave(Symbol group) {
+        auto it = lower_bound(groups.begin(), groups.end(), group);
+        if (it != groups.end() && *it == group) {
+            groups.erase(it);
+        }
+    }
+};
+
+//io_uring driven by raw system calls: the submission and completion rings are memory shared with the kernel,
+//entries are written and read in place and a single io_uring_enter submits everything queued and waits for completions
+struct Uring {
+    int fd = -1;
+    io_uring_params params{};
+    void* rings = MAP_FAILED; //both rings in one mapping
+    size_t rings_bytes = 0;
+    io_uring_sqe* sqes = (io_uring_sqe*)MAP_FAILED;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_array;
+    unsigned sq_mask;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    io_uring_cqe* cqes;
+    unsigned queued = 0; //entries written since the last submit
+    //provided buffer ring: the kernel picks a free receive buffer when data arrives, so idle connections hold no buffer.
+    //used as a plain array, the C++ layout of io_uring_buf_ring puts bufs 8 bytes after the tail the kernel expects
+    io_uring_buf* buffers = (io_uring_buf*)MAP_FAILED;
+    char* buffer_memory = nullptr;
+    size_t buffer_size = 0;
+    uint16_t buffer_tail = 0;
+
+    ~Uring() {
+        if (buffers != MAP_FAILED) {
+            munmap(buffers, URING_BUFFERS * sizeof(io_uring_buf));
+        }
+        free(buffer_memory);
+        if (sqes != MAP_FAILED) {
+            munmap(sqes, params.sq_entries * sizeof(io_uring_sqe));
+        }
+        if (rings != MAP_FAILED) {
+            munmap(rings, rings_bytes);
+        }
+        if (fd != -1) {
+            close(fd);
+        }
     }
-    
-    cout << "Server is listening for incoming clients on port number " << PORT << "...\n" << endl;
 
-    int client_socket;
-    sockaddr_in clt_sock_addr;
-    socklen_t clientSize = sizeof(clt_sock_addr);
+    //set up the rings and the receive buffers, false if the kernel lacks something the backend needs
+    bool init(size_t bufferSize) {
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = URING_CQ_ENTRIES;
+        fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+        //the completion ring must never drop entries, and waiting needs a timeout for the timer wheel
+        if (fd == -1 || !(params.features & IORING_FEAT_NODROP) || !(params.features & IORING_FEAT_EXT_ARG) || !(params.features & IORING_FEAT_SINGLE_MMAP)) {
+            return false;
+        }
+        rings_bytes = max(params.sq_off.array + params.sq_entries * sizeof(unsigned), params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+        rings = mmap(nullptr, rings_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        sqes = (io_uring_sqe*)mmap(nullptr, params.sq_entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+        if (rings == MAP_FAILED || sqes == MAP_FAILED) {
+            return false;
+        }
+        char* sq = (char*)rings;
+        sq_head = (unsigned*)(sq + params.sq_off.head);
+        sq_tail = (unsigned*)(sq + params.sq_off.tail);
+        sq_array = (unsigned*)(sq + params.sq_off.array);
+        sq_mask = *(unsigned*)(sq + params.sq_off.ring_mask);
+        cq_head = (unsigned*)(sq + params.cq_off.head);
+        cq_tail = (unsigned*)(sq + params.cq_off.tail);
+        cq_mask = *(unsigned*)(sq + params.cq_off.ring_mask);
+        cqes = (io_uring_cqe*)(sq + params.cq_off.cqes);
 
-    while(true){
+        buffers = (io_uring_buf*)mmap(nullptr, URING_BUFFERS * sizeof(io_uring_buf), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        buffer_size = bufferSize;
+        buffer_memory = (char*)malloc(URING_BUFFERS * bufferSize);
+        if (buffers == MAP_FAILED || buffer_memory == nullptr) {
+            return false;
+        }
+        io_uring_buf_reg reg{};
+        reg.ring_addr = (uint64_t)buffers;
+        reg.ring_entries = URING_BUFFERS;
+        reg.bgid = 0;
+        if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+            return false;
+        }
+        for (uint16_t bid = 0; bid < URING_BUFFERS; bid++) {
+            recycle(bid, false);
+        }
+        publish_buffers();
+        return true;
+    }
 
-        //awaits a connection, and upon recieving one creates a new socket to communicate
-        client_socket = accept(server_socket, (sockaddr*)&clt_sock_addr, &clientSize);
-        if (client_socket == -1) {
-            cerr << "Error: Problem with client connecting!\n" <<endl;
-            return 4;
+    //a free submission entry, submitting what is queued first if the ring is full
+    io_uring_sqe* sqe() {
+        unsigned tail = *sq_tail;
+        if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= params.sq_entries) {
+            enter(0, -1);
         }
-        //On successful connection of client to the server, create a new thread for the client and then call the function to handle the client
-        thread(clientHandler, client_socket).detach();
-        // Detach the newly created client thread to allow it to run independently from the main listening thread which can freely continue listening for new clients
-        
+        io_uring_sqe* e = &sqes[tail & sq_mask];
+        memset(e, 0, sizeof(*e));
+        sq_array[tail & sq_mask] = tail & sq_mask;
+        __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+        queued++;
+        return e;
     }
-    close(server_socket);
-    return 0;
-}
\ No newline at end of file
+
+    //submit everything queued and wait for `wait` completions, at most waitMs milliseconds unless it is -1
+    void enter(unsigned wait, int waitMs) {
+        __kernel_timespec ts{waitMs / 1000, (long long)(waitMs % 1000) * 1000000};
+        io_uring_getevents_arg arg{};
+        arg.sigmask_sz = _NSIG / 8;
+        arg.ts = waitMs >= 0 ? (uint64_t)&ts : 0;
+        unsigned flags = wait > 0 ? IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG : 0;
+        int submitted = (int)syscall(__NR_io_uring_enter, fd, queued, wait, flags, wait > 0 ? &arg : nullptr, sizeof(arg));
+        if (submitted > 0) {
+            queued -= min<unsigned>(queued, submitted);
+        }
+    }
+
+    //give a receive buffer back to the kernel, visible to it after publish_buffers
+    void recycle(uint16_t bid, bool publish = true) {
+        io_uring_buf& b = buffers[buffer_tail & (URING_BUFFERS - 1)];
+        b.addr = (uint64_t)(buffer_memory + bid * buffer_size);
+        b.len = (uint32_t)buffer_size;
+        b.bid = bid;
+        buffer_tail++;
+        if (publish) {
+            publish_buffers();
+        }
+    }
+
+    void publish_buffers() {
+        __atomic_store_n(&buffers[0].resv, buffer_tail, __ATOMIC_RELEASE); //the tail shares the first entry
+    }
+
+    //call handle(cqe) for every completion that arrived
+    template <typename Handle>
+    void reap(Handle handle) {
+        unsigned head = *cq_head;
+        while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+            io_uring_cqe cqe = cqes[head & cq_mask];
+            __atomic_store_n(cq_head, ++head, __ATOMIC_RELEASE); //the entry is copied, the kernel may reuse its slot
+            handle(cqe);
+        }
+    }
+};
+
+//what an io_uring completion is for, in the upper half of its user data, the socket is in the lower half
+enum UringOp : uint64_t { URING_WAKE = 1, URING_ACCEPT, URING_RECV, URING_SEND, URING_CANCEL };
+
+uint64_t uring_data(UringOp op, int sock) {
+    return (uint64_t)op << 32 | (uint32_t)sock;
+}
+
+//what an event loop is doing, only changed by its own thread
+enum class LoopPhase {
+    Serving,
+    Frozen, //a hot restart is handing the clients over: nothing is read, written or timed out until it is done or fails
+    Closing, //shutting down: nothing is read, every client is closed once its output is written
+    Stopped, //every client is closed, the loop thread ends
+};
+
+struct SessionImage;
+struct StateWriter;
+
+//epoll reactor, each loop owns a set of connections and serves all of them from a single thread
+struct EventLoop {
+    int epfd = -1; //epoll instance
+    int wakefd = -1; //eventfd used by other threads to wake the loop up
+    int listenfd = -1; //own SO_REUSEPORT listening socket, -1 when the main thread accepts for the loop
+    size_t index; //position in event_loops
+    mutex inbox_mutex; //protects inbox and deliveries
+    vector<function<void()>> inbox; //tasks posted by other threads, run on the loop thread
+    vector<Delivery> deliveries; //messages posted by other threads, queued on the loop thread
+    vector<function<void()>> running; //inbox being run, swapped with inbox so that both keep their capacity
+    vector<Delivery> delivering; //deliveries being queued, likewise
+    unordered_map<int, unique_ptr<Session>> sessions; //socket > session, touched only by the loop thread
+    vector<int> dirty; //sessions with queued output to flush at the end of the current iteration
+    vector<int> doomed; //sessions to close at the end of the current iteration
+    vector<int> flushing; //dirty or doomed sessions being handled, swapped with them
+    TimerWheel timers; //login, idle and ping timers of the loop's sessions
+    unique_ptr<Uring> ring; //io_uring backend, nullptr with epoll
+    bool accept_armed = false; //io_uring: the multishot accept of listenfd is in the kernel
+    LoopPhase phase = LoopPhase::Serving;
+    thread worker;
+
+    EventLoop();
+    void post(function<void()> task);
+    void post(span<const Recipient> recipients, const MsgBuf& msg);
+    void post_broadcast(const MsgBuf& msg, int except);
+    Session* start_session(int sock);
+    void add_session(int sock);
+    void adopt_session(int sock, const SessionImage& image);
+    void drop_session(int sock);
+    void schedule_close(Session& session);
+    void enqueue(Session& session, const MsgBuf& msg);
+    bool flush(Session& session);
+    void reap_zerocopy(Session& session);
+    void flush_pending();
+    void accept_clients();
+    void on_readable(int sock);
+    void on_timer(Session& session, uint64_t now);
+    void run_inbox();
+    void run();
+    void arm_accept();
+    void arm_recv(Session& session);
+    void submit_send(Session& session);
+    void cancel(UringOp op, int sock);
+    void finish_drain(int sock);
+    void on_completion(const io_uring_cqe& cqe);
+    void run_uring();
+    bool settled(Session& session);
+    void freeze();
+    bool quiet();
+    void thaw();
+    void save_sessions(StateWriter& out, vector<int>& socks);
+    void begin_close(const MsgBuf& notice);
+    void close_finished();
+};
+
+vector<unique_ptr<EventLoop>> event_loops; //empty in thread mode
+thread_local EventLoop* current_loop = nullptr; //event loop run by the calling thread, if any
+
+//fixed set of worker threads running the sessions' strands, decoupled from the I/O of the event loops
+//every worker has its own queue, a worker with nothing to do steals the oldest strand of another one
+struct Executor {
+    struct alignas(64) Queue {
+        mutex lock;
+        deque<Session*> strands;
+    };
+    vector<unique_ptr<Queue>> queues; //one per worker
+    atomic<size_t> queued{0}; //strands waiting in any queue
+    atomic<size_t> sleeping{0}; //workers waiting for work
+    atomic<size_t> next{0}; //round robin over the queues for strands submitted by the event loops
+    mutex idle_lock;
+    condition_variable wake;
+
+    explicit Executor(int workers);
+    void input(Session& session, string_view msg);
+    void close(Session* session);
+    void resume(Session& session, bool ok);
+    void submit(Session* session);
+    Session* take(size_t self);
+    void run_strand(Session* session);
+    void run(size_t self);
+};
+unique_ptr<Executor> executor; //nullptr unless --workers is set
+thread_local size_t current_worker = SIZE_MAX; //queue of the worker run by the calling thread, if any
+
+//per-socket bookkeeping, indexed by socket number
+struct SocketSlot {
+    mutex write_mutex; //serializes writers of the socket with its closing
+    atomic<EventLoop*> loop{nullptr}; //owning event loop, nullptr in thread mode
+    atomic<uint32_t> epoch{0}; //bumped when the socket is closed, so a reused socket number never gets stale deliveries
+    Session* session = nullptr; //session served by the owning event loop, only used by that loop
+};
+unique_ptr<SocketSlot[]> socket_slots;
+int socket_slot_count = 0;
+
+Recipient recipient_of(int sock) {
+    return {sock, socket_slots[sock].epoch.load()};
+}
+
+//write all of iov to a blocking socket (thread mode), false on a write error
+//a signal stopping the client threads for a hot restart may cut a call short, the rest is written by the next one
+bool send_all(int sock, iovec* iov, int n) {
+    msghdr mh{};
+    mh.msg_iov = iov;
+    mh.msg_iovlen = n;
+    while (mh.msg_iovlen > 0) {
+        ssize_t written = sendmsg(sock, &mh, MSG_NOSIGNAL);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        size_t done = written;
+        while (mh.msg_iovlen > 0 && done >= mh.msg_iov->iov_len) {
+            done -= mh.msg_iov->iov_len;
+            mh.msg_iov++;
+            mh.msg_iovlen--;
+        }
+        if (mh.msg_iovlen > 0) {
+            mh.msg_iov->iov_base = (char*)mh.msg_iov->iov_base + done;
+            mh.msg_iov->iov_len -= done;
+        }
+    }
+    return true;
+}
+
+//write to a socket unless it was closed after the recipient was resolved
+void write_to(const Recipient& r, const MsgBuf& msg) {
+    SocketSlot& slot = socket_slots[r.sock];
+
+    //event loops never block on a client, the message joins the client's outbound queue on the owning loop
+    EventLoop* owner = slot.loop.load();
+    if (owner != nullptr) {
+        if (owner != current_loop) {
+            owner->post({&r, 1}, msg); //from a worker or another loop
+        } else if (slot.epoch.load() == r.epoch && slot.session != nullptr) {
+            owner->enqueue(*slot.session, msg);
+        }
+        return;
+    }
+
+    //thread mode: blocking send
+    lock_guard<mutex> lock(slot.write_mutex);
+    if (slot.epoch.load() != r.epoch) {
+        return;
+    }
+    count(metrics().messages_sent);
+
+    //the frame header (framed mode) and the message go out in one call without copying the message
+    uint8_t header[11];
+    size_t headerLen = frame_header(header, msg.size);
+    iovec iov[2] = {{header, headerLen}, {(void*)msg.data, msg.size}};
+    send_all(r.sock, iov, 2);
+}
+
+//reply to the client being served
+void send_to(int sock, string_view msg) {
+    write_to(recipient_of(sock), make_msg(msg));
+}
+
+void send_to(int sock, initializer_list<string_view> parts) {
+    write_to(recipient_of(sock), make_msg(parts));
+}
+
+//send a null-terminated message to a socket
+void send_text(int sock, const char* msg) {
+    send_to(sock, msg);
+}
+
+//deliver a message to a set of recipients, recipients owned by another event loop get it through that loop's inbox
+void fan_out(span<const Recipient> recipients, const MsgBuf& msg) {
+    metrics().fanout.record(recipients.size());
+    thread_local vector<vector<Recipient>> remote; //by loop index, cleared but kept between calls
+    remote.resize(event_loops.size());
+    bool posted = false;
+    for (const Recipient& r : recipients) {
+        EventLoop* owner = socket_slots[r.sock].loop.load();
+        if (owner == nullptr || owner == current_loop) {
+            write_to(r, msg);
+        } else {
+            remote[owner->index].push_back(r);
+            posted = true;
+        }
+    }
+
+    //one batch per loop, every loop and every queue shares the same message
+    if (posted) {
+        for (size_t i = 0; i < remote.size(); i++) {
+            if (!remote[i].empty()) {
+                event_loops[i]->post(remote[i], msg);
+                remote[i].clear();
+            }
+        }
+    }
+}
+
+//header of a message in a store segment, followed by the recipient name and the message, padded to 8 bytes
+struct StoreRecord {
+    uint32_t size; //bytes of recipient and message, 0 marks the end of the segment's records
+    uint32_t checksum; //FNV-1a of recipient and message, a record torn by a crash does not match
+    uint16_t recipientLen;
+    uint16_t flags; //STORE_DELIVERED once replayed, not covered by the checksum
+    uint32_t messageLen;
+};
+
+//one memory mapped, fixed size segment file of the store
+struct Segment {
+    uint64_t number = 0;
+    string path;
+    int fd = -1;
+    char* base = nullptr;
+    size_t size = 0;
+    size_t end = 0; //bytes used by records
+    size_t live = 0; //records not delivered yet
+    size_t dirtyFrom = SIZE_MAX; //range changed since the last sync
+    size_t dirtyTo = 0;
+
+    ~Segment() {
+        if (base != nullptr) {
+            munmap(base, size);
+        }
+        if (fd != -1) {
+            close(fd);
+        }
+    }
+    StoreRecord* record(size_t offset) {
+        return reinterpret_cast<StoreRecord*>(base + offset);
+    }
+};
+
+//an undelivered message: its segment and the offset of its record
+struct StoredMessage {
+    shared_ptr<Segment> segment;
+    uint32_t offset;
+};
+
+//append-only store of private messages for offline users, segments are deleted once all their messages are delivered
+struct MessageStore {
+    mutex lock;
+    condition_variable wake; //wakes the sync thread
+    map<uint64_t, shared_ptr<Segment>> segments; //segment number > segment
+    shared_ptr<Segment> active; //segment appended to
+    unordered_map<string, vector<StoredMessage>> pending; //recipient > undelivered messages in arrival order
+    vector<shared_ptr<Segment>> dirty; //segments changed since the last sync
+    vector<pair<Recipient, MsgBuf>> acks; //confirmations for the senders, sent once their messages are on disk
+};
+MessageStore store;
+
+size_t record_bytes(size_t payload) {
+    return (sizeof(StoreRecord) + payload + 7) & ~size_t(7);
+}
+
+uint32_t store_checksum(const char* data, size_t len) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ (uint8_t)data[i]) * 16777619u;
+    }
+    return hash;
+}
+
+//open (or create at the configured size) and map a segment file, nullptr on failure
+shared_ptr<Segment> map_segment(uint64_t number, bool create) {
+    auto segment = make_shared<Segment>();
+    segment->number = number;
+    char name[48];
+    snprintf(name, sizeof(name), "/segment-%020llu.log", (unsigned long long)number);
+    segment->path = config.store_dir + name;
+    segment->fd = open(segment->path.c_str(), O_RDWR | O_CLOEXEC | (create ? O_CREAT | O_EXCL : 0), 0600);
+    if (segment->fd == -1) {
+        return nullptr;
+    }
+    if (create && ftruncate(segment->fd, config.store_segment) == -1) {
+        return nullptr;
+    }
+    struct stat st{};
+    fstat(segment->fd, &st);
+    segment->size = st.st_size;
+    void* base = mmap(nullptr, segment->size, PROT_READ | PROT_WRITE, MAP_SHARED, segment->fd, 0);
+    if (segment->size == 0 || base == MAP_FAILED) {
+        return nullptr;
+    }
+    segment->base = static_cast<char*>(base);
+    return segment;
+}
+
+//remember a changed range for the next sync, called with the store locked
+void mark_dirty(const shared_ptr<Segment>& segment, size_t from, size_t to) {
+    if (segment->dirtyFrom == SIZE_MAX) {
+        store.dirty.push_back(segment);
+    }
+    segment->dirtyFrom = min(segment->dirtyFrom, from);
+    segment->dirtyTo = max(segment->dirtyTo, to);
+}
+
+//a segment whose messages are all delivered is not needed any more, mappings still in use stay valid until released
+void retire_segment(const shared_ptr<Segment>& segment) {
+    if (segment->live == 0 && segment != store.active) {
+        unlink(segment->path.c_str());
+        store.segments.erase(segment->number);
+    }
+}
+
+//sync thread: every round writes back everything appended while the previous round was syncing (group commit)
+void sync_store() {
+    unique_lock<mutex> lock(store.lock);
+    while (true) {
+        store.wake.wait(lock, [] { return !store.dirty.empty(); });
+        vector<pair<shared_ptr<Segment>, pair<size_t, size_t>>> ranges;
+        for (auto& segment : store.dirty) {
+            ranges.push_back({segment, {segment->dirtyFrom, segment->dirtyTo}});
+            segment->dirtyFrom = SIZE_MAX;
+            segment->dirtyTo = 0;
+        }
+        store.dirty.clear();
+        vector<pair<Recipient, MsgBuf>> acks;
+        acks.swap(store.acks);
+        lock.unlock();
+
+        size_t page = sysconf(_SC_PAGESIZE);
+        for (auto& range : ranges) {
+            size_t from = range.second.first & ~(page - 1);
+            msync(range.first->base + from, range.second.second - from, MS_SYNC);
+        }
+        for (auto& ack : acks) {
+            fan_out({&ack.first, 1}, ack.second);
+        }
+        lock.lock();
+    }
+}
+
+//write every segment back before the process exits, whatever the sync thread is doing
+void flush_store() {
+    if (config.store_dir.empty()) {
+        return;
+    }
+    lock_guard<mutex> lock(store.lock);
+    for (auto& entry : store.segments) {
+        msync(entry.second->base, entry.second->end, MS_SYNC);
+    }
+}
+
+//map the existing segments, index the messages not delivered yet and start the sync thread, returns false on failure
+bool open_store() {
+    mkdir(config.store_dir.c_str(), 0700);
+    DIR* dir = opendir(config.store_dir.c_str());
+    if (dir == nullptr) {
+        return false;
+    }
+    vector<uint64_t> numbers;
+    while (dirent* entry = readdir(dir)) {
+        unsigned long long number;
+        if (sscanf(entry->d_name, "segment-%llu.log", &number) == 1) {
+            numbers.push_back(number);
+        }
+    }
+    closedir(dir);
+    sort(numbers.begin(), numbers.end());
+
+    size_t recovered = 0;
+    for (uint64_t number : numbers) {
+        shared_ptr<Segment> segment = map_segment(number, false);
+        if (!segment) {
+            return false;
+        }
+        //records are checked in order, the first empty or torn one ends the segment
+        size_t offset = 0;
+        while (offset + sizeof(StoreRecord) <= segment->size) {
+            StoreRecord* r = segment->record(offset);
+            const char* payload = segment->base + offset + sizeof(StoreRecord);
+            if (r->size == 0 || offset + record_bytes(r->size) > segment->size || r->recipientLen + r->messageLen != r->size || store_checksum(payload, r->size) != r->checksum) {
+                break;
+            }
+            if (!(r->flags & STORE_DELIVERED)) {
+                store.pending[string(payload, r->recipientLen)].push_back({segment, (uint32_t)offset});
+                segment->live++;
+                recovered++;
+            }
+            offset += record_bytes(r->size);
+        }
+        segment->end = offset;
+        store.segments[number] = segment;
+        store.active = segment;
+    }
+    for (auto it = store.segments.begin(); it != store.segments.end();) {
+        shared_ptr<Segment> segment = (it++)->second;
+        retire_segment(segment);
+    }
+    if (!store.active) {
+        store.active = map_segment(0, true);
+        if (!store.active) {
+            return false;
+        }
+        store.segments[0] = store.active;
+    }
+    cout << "Recovered " << recovered << " undelivered messages from " << config.store_dir << "\n" << endl;
+    thread(sync_store).detach();
+    return true;
+}
+
+//append a message for an offline user, the sender gets ack once the message is on disk, returns false if it can not be stored
+bool store_message(string_view recipient, string_view message, const Recipient& sender, const MsgBuf& ack) {
+    size_t payload = recipient.size() + message.size();
+    size_t bytes = record_bytes(payload);
+    if (recipient.size() > UINT16_MAX || bytes > config.store_segment) {
+        return false;
+    }
+    lock_guard<mutex> lock(store.lock);
+
+    //start the next segment when the active one is full
+    shared_ptr<Segment> segment = store.active;
+    if (segment->end + bytes > segment->size) {
+        shared_ptr<Segment> next = map_segment(segment->number + 1, true);
+        if (!next) {
+            return false;
+        }
+        store.segments[next->number] = next;
+        store.active = next;
+        retire_segment(segment);
+        segment = next;
+    }
+
+    //payload first, the header (with the checksum) completes the record
+    size_t offset = segment->end;
+    char* data = segment->base + offset + sizeof(StoreRecord);
+    memcpy(data, recipient.data(), recipient.size());
+    memcpy(data + recipient.size(), message.data(), message.size());
+    StoreRecord* r = segment->record(offset);
+    r->recipientLen = (uint16_t)recipient.size();
+    r->messageLen = (uint32_t)message.size();
+    r->flags = 0;
+    r->checksum = store_checksum(data, payload);
+    r->size = (uint32_t)payload;
+    segment->end += bytes;
+    segment->live++;
+    mark_dirty(segment, offset, segment->end);
+
+    store.pending[string(recipient)].push_back({segment, (uint32_t)offset});
+    store.acks.emplace_back(sender, ack);
+    store.wake.notify_one();
+    count(metrics().offline_stored);
+    return true;
+}
+
+//send a client that just logged in the messages stored while it was offline, straight from the mapped segments
+void replay_stored(Session& session) {
+    if (config.store_dir.empty()) {
+        return;
+    }
+    vector<MsgBuf> messages;
+    {
+        lock_guard<mutex> lock(store.lock);
+        auto it = store.pending.find(session.username);
+        if (it == store.pending.end()) {
+            return;
+        }
+        messages.reserve(it->second.size());
+        for (const StoredMessage& stored : it->second) {
+            Segment& segment = *stored.segment;
+            StoreRecord* r = segment.record(stored.offset);
+            const char* text = segment.base + stored.offset + sizeof(StoreRecord) + r->recipientLen;
+            messages.push_back({stored.segment, text, r->messageLen});
+
+            //the delivered flag is synced with the next group commit
+            r->flags |= STORE_DELIVERED;
+            mark_dirty(stored.segment, stored.offset, stored.offset + sizeof(StoreRecord));
+            segment.live--;
+            retire_segment(stored.segment);
+        }
+        store.pending.erase(it);
+        store.wake.notify_one();
+    }
+    Recipient self{session.sock, session.epoch};
+    for (const MsgBuf& message : messages) {
+        write_to(self, message);
+    }
+    count(metrics().offline_delivered, messages.size());
+}
+
+//position of a socket in the members, or where it would be inserted
+static vector<Member>::iterator member_position(vector<Member>& members, int sock) {
+    return lower_bound(members.begin(), members.end(), sock, [](const Member& m, int s) { return m.conn.sock < s; });
+}
+
+void Group::add(Session* session) {
+    auto it = member_position(members, session->sock);
+    if (it != members.end() && it->session == session) {
+        return;
+    }
+    members.insert(it, {{session->sock, session->epoch}, session});
+    member_socks.insert(session->sock);
+}
+
+void Group::remove(Session* session) {
+    auto it = member_position(members, session->sock);
+    if (it == members.end() || it->session != session) {
+        return;
+    }
+    members.erase(it);
+    member_socks.erase(session->sock);
+}
+
+void Group::retire() {
+    deleted = true;
+    vector<Member>().swap(members);
+    vector<uint64_t>().swap(member_socks.words);
+    lock_guard<mutex> historyLock(history_lock);
+    history = History();
+}
+
+//create a group
+void create_group(Session& session, string_view group_name){ //takes the client session and group name to create a group with client as first member
+
+    //a name has to be usable by every group command: /group_msg ends it at a space, /multi_group_msg splits it at commas
+    if (group_name.empty() || group_name.find_first_of(" ,") != string_view::npos) {
+        send_to(session.sock, "Error: A group name can not be empty or contain spaces or commas!\n");
+        return;
+    }
+
+    //a new group is counted against --max-groups before its name is interned, the other group commands only look names up
+    Symbol group_id = symbols.find(group_name);
+    Group* group = find_group(group_id);
+    if (group == nullptr) {
+        if (!reserve_group()) {
+            send_to(session.sock, "Error: Too many groups!\n");
+            return;
+        }
+        group_id = symbols.intern(group_name);
+        if (group_id == NO_SYMBOL) {
+            group_count--;
+            send_to(session.sock, "Error: Too many groups!\n");
+            return;
+        }
+
+        //the first /create_group of a name makes its group, if two race the one that loses uses the other's
+        atomic<Group*>& slot = symbols.entry(group_id).group;
+        auto fresh = make_unique<Group>();
+        if (slot.compare_exchange_strong(group, fresh.get())) {
+            group = fresh.release();
+        } else {
+            group_count--;
+        }
+    }
+
+    //lock the group using std::unique_lock, released before replying, and check if it already exists
+    unique_lock<shared_mutex> lock(group->lock);
+    if (!group->deleted) {
+        lock.unlock();
+        send_to(session.sock, {"Error: Group ", group_name, " already exists!\n"});
+        return;
+    }
+    //add client as first member
+    group->deleted = false;
+    group->add(&session);
+    groups_version++;
+    lock.unlock();
+    session.join(group_id);
+
+    //inform client
+    send_to(session.sock, {"Group ", group_name, " created successfully, and you are added as the first member.\n"});
+}
+
+//join a group
+void join_group(Session& session, Symbol group_id, string_view group_name) { //takes the client session and group to add client as member
+
+    //checks if group exists, then locks only that group using std::unique_lock, released before notifying the members
+    Group* group = find_group(group_id);
+    unique_lock<shared_mutex> lock;
+    if (group) {
+        lock = unique_lock<shared_mutex>(group->lock);
+    }
+    if (!group || group->deleted) {
+        if (lock) {
+            lock.unlock();
+        }
+        send_to(session.sock, {"Error: Group ", group_name, " does not exist!\n"});
+        return;
+    }
+
+    //add client as member
+    group->add(&session);
+    groups_version++;
+    session.join(group_id);
+
+    // Collect all members of the group except the joining client
+    vector<Recipient> members;
+    members.reserve(group->members.size());
+    for (const Member& member : group->members) {
+        if (member.session != &session) {
+            members.push_back(member.conn);
+        }
+    }
+    lock.unlock();
+
+    //inform client
+    send_to(session.sock, {"You have successfully joined the group ", group_name, ".\n"});
+
+    // Send a group message to all members of the group informing them of who has joined
+    fan_out(members, make_msg({session.username, " has joined the group ", group_name, ".\n"}));
+}
+
+//leave group
+void leave_group(Session& session, Symbol group_id, string_view group_name) { //takes the client session and group to remove client as member
+
+    //checks if group exists, then locks only that group using std::unique_lock, released before notifying the members
+    Group* group = find_group(group_id);
+    unique_lock<shared_mutex> lock;
+    if (group) {
+        lock = unique_lock<shared_mutex>(group->lock);
+    }
+    if (!group || group->deleted) {
+        if (lock) {
+            lock.unlock();
+        }
+        send_to(session.sock, {"Error: Group ", group_name, " does not exist!\n"});
+        return;
+    }
+
+    //remove client as member
+    group->remove(&session);
+    groups_version++;
+    session.leave(group_id);
+
+    //delete group if empty otherwise inform client
+    if (group->members.empty()) {
+        group->retire();
+        lock.unlock();
+        send_to(session.sock, {"Group ", group_name, " is now empty and has been deleted.\n"});
+        return;
+    }
+
+    // Collect the remaining members of the group
+    vector<Recipient> members;
+    members.reserve(group->members.size());
+    for (const Member& member : group->members) {
+        members.push_back(member.conn);
+    }
+    lock.unlock();
+
+    send_to(session.sock, {"You have successfully left the group ", group_name, ".\n"});
+
+    // Send a group message to all members of the group informing them of who has left
+    fan_out(members, make_msg({session.username, " has left the group ", group_name, ".\n"}));
+}
+
+//send a listing, or the page of it from entry offset on with at most limit entries, in one write
+void send_listing(Session& session, const shared_ptr<const Listing>& listing, size_t offset, size_t limit, const char* noun) {
+    size_t total = listing->starts.size() - 1;
+    if (offset == 0 && limit >= total) {
+        //the whole listing goes out straight from the cache
+        write_to(Recipient{session.sock, session.epoch}, {listing, listing->text.data(), listing->text.size()});
+        return;
+    }
+    if (offset >= total) {
+        send_to(session.sock, {"No ", noun, " from ", to_string(offset), " on, there are ", to_string(total), ".\n"});
+        return;
+    }
+    size_t last = offset + min(limit, total - offset);
+    string_view page(listing->text.data() + listing->starts[offset], listing->starts[last] - listing->starts[offset]);
+    send_to(session.sock, {page, "Showing ", noun, " ", to_string(offset), " to ", to_string(last - 1), " of ", to_string(total), ".\n"});
+}
+
+//the cached listing, rendered again first if what it lists changed since
+template <typename Render>
+shared_ptr<const Listing> current_listing(atomic<shared_ptr<const Listing>>& cache, const atomic<uint64_t>& version, Render render) {
+    shared_ptr<const Listing> listing = cache.load();
+    uint64_t now = version.load();
+    if (listing && listing->version == now) {
+        return listing;
+    }
+    //changes made while rendering carry a newer version, so a listing that missed them is rendered again next time
+    auto fresh = make_shared<Listing>();
+    fresh->version = now;
+    render(*fresh);
+    fresh->starts.push_back(fresh->text.size());
+    cache.store(fresh);
+    return fresh;
+}
+
+//print all connected clients
+void print_clients(Session& session, size_t offset, size_t limit){ //takes the client session and the page to print connected clients for the client
+
+    //rendered under a shared lock only when someone logged in or out since the last time, logins and logouts wait for the rendering only
+    shared_ptr<const Listing> listing = current_listing(clients_listing, clients_version, [](Listing& out) {
+        shared_lock<shared_mutex> lock(client_mutex);
+        out.starts.reserve(clients.size() + 1);
+        for (const auto& client : clients) {
+            out.starts.push_back(out.text.size());
+            out.text.append("- ").append(symbols.name(client.first)).append(" (Socket: ").append(to_string(client.second->sock)).append(")\n");
+        }
+    });
+
+    //print clients
+    send_listing(session, listing, offset, limit, "users");
+}
+
+//print all active groups
+void print_groups(Session& session, size_t offset, size_t limit) { //takes the client session and the page to print active groups for the client
+
+    //rendered under shared locks, one group at a time in the order their names were first seen, only when a group changed since the last time
+    shared_ptr<const Listing> listing = current_listing(groups_listing, groups_version, [](Listing& out) {
+        Symbol count = symbols.count.load(memory_order_acquire);
+        for (Symbol id = 0; id < count; id++) {
+            Group* group = find_group(id);
+            if (group == nullptr) {
+                continue;
+            }
+            shared_lock<shared_mutex> groupLock(group->lock);
+            if (group->deleted) {
+                continue;
+            }
+            out.starts.push_back(out.text.size());
+            out.text.append("- ").append(symbols.name(id)).append("\n");
+
+            // every member session knows its own username
+            for (const Member& member : group->members) {
+                out.text.append("  * ").append(member.session->username).append(" (Socket: ").append(to_string(member.conn.sock)).append(")\n");
+            }
+        }
+    });
+
+    //check if no groups are available
+    if (listing->starts.size() == 1) {
+        send_to(session.sock, "Error: No groups available.\n");
+        return;
+    }
+
+    //print groups
+    send_listing(session, listing, offset, limit, "groups");
+}
+
+//collect the members of a group except the sender, returns nullptr if the group does not exist
+Group* group_recipients(const Session& session, Symbol group_id, vector<Recipient>& members) {
+
+    //take only that group's lock, in shared mode so messages to the same group do not wait for each other either
+    Group* group = find_group(group_id);
+    if (!group) {
+        return nullptr;
+    }
+    shared_lock<shared_mutex> lock(group->lock);
+    if (group->deleted) {
+        return nullptr;
+    }
+    members.reserve(group->members.size());
+    for (const Member& member : group->members) {
+        if (member.session != &session) {
+            members.push_back(member.conn);
+        }
+    }
+    return group;
+}
+
+//send a message to a group
+void group_message(Session& session, Symbol group_id, string_view group_name, string_view message) { //takes the client session, group and message to send message to a group
+
+        //check if group exists and collect all client sockets in group, into a list that keeps its capacity
+        thread_local vector<Recipient> members;
+        members.clear();
+        Group* group = group_recipients(session, group_id, members);
+        if (!group) {
+            send_to(session.sock, {"Error: Group ", group_name, " does not exist!\n"});
+            return;
+        }
+
+        //keep it for /history, then send message to all client sockets in group
+        MsgBuf formattedMsg = make_msg({"[", group_name, "] ", session.username, ": ", message, "\n"});
+        {
+            lock_guard<mutex> lock(group->history_lock);
+            group->history.add(string_view(formattedMsg.data, formattedMsg.size));
+        }
+        fan_out(members, formattedMsg);
+
+        //confirm to sending client
+        send_to(session.sock, {"Message sent to group ", group_name, ".\n"});
+    }
+
+//recipients of one message to several groups, every connection once however many of the groups it is in: the member
+//bitsets of the groups are combined a word at a time and only the bits no earlier group had set become recipients
+struct FanoutPlan {
+    vector<uint64_t> seen; //sockets planned so far, and the sender's
+    vector<uint64_t> fresh; //sockets the group being added brings in
+    vector<Recipient> recipients;
+
+    void start(int sender) {
+        fill(seen.begin(), seen.end(), 0);
+        recipients.clear();
+        size_t w = (size_t)sender >> 6;
+        if (seen.size() <= w) {
+            seen.resize((w / SocketSet::BLOCK + 1) * SocketSet::BLOCK);
+            fresh.resize(seen.size());
+        }
+        seen[w] |= 1ull << (sender & 63);
+    }
+
+    //under the group's lock, so the recipients' epochs are those of the members
+    void add(const SocketSet& members) {
+        size_t n = members.words.size();
+        if (seen.size() < n) {
+            seen.resize(n);
+            fresh.resize(n);
+        }
+        //a block of words at a time, in vector registers
+        for (size_t w = 0; w < n; w += SocketSet::BLOCK) {
+            WordBlock in, done;
+            memcpy(&in, &members.words[w], sizeof(in));
+            memcpy(&done, &seen[w], sizeof(done));
+            WordBlock added = in & ~done;
+            done |= in;
+            memcpy(&fresh[w], &added, sizeof(added));
+            memcpy(&seen[w], &done, sizeof(done));
+        }
+        for (size_t w = 0; w < n; w++) {
+            for (uint64_t bits = fresh[w]; bits != 0; bits &= bits - 1) {
+                recipients.push_back(recipient_of((int)(w * 64 + countr_zero(bits))));
+            }
+        }
+    }
+};
+
+//send one message to several groups, "g1,g2,g3": a client in more than one of them gets it once
+void multi_group_message(Session& session, string_view group_list, string_view message) {
+
+    //the groups, each once, all of them groups the client is a member of
+    thread_local vector<pair<Symbol, string_view>> names;
+    names.clear();
+    for (size_t start = 0; start <= group_list.size();) {
+        size_t comma = min(group_list.find(',', start), group_list.size());
+        string_view name = group_list.substr(start, comma - start);
+        start = comma + 1;
+        if (name.empty()) {
+            continue;
+        }
+        Symbol id = symbols.find(name);
+        if (!session.member_of(id)) {
+            send_to(session.sock, {"Error: You are not a member of the group ", name, ".\n"});
+            return;
+        }
+        if (find_if(names.begin(), names.end(), [id](const auto& n) { return n.first == id; }) == names.end()) {
+            names.emplace_back(id, name);
+        }
+    }
+    if (names.empty()) {
+        send_to(session.sock, "Error: Usage: /multi_group_msg <group1>,<group2>,... <message>\n");
+        return;
+    }
+
+    //each group is locked on its own while its members are added to the plan
+    thread_local FanoutPlan plan;
+    thread_local vector<Group*> groups;
+    plan.start(session.sock);
+    groups.clear();
+    for (auto [id, name] : names) {
+        Group* group = find_group(id);
+        if (group) {
+            shared_lock<shared_mutex> lock(group->lock);
+            if (!group->deleted) {
+                plan.add(group->member_socks);
+                groups.push_back(group);
+                continue;
+            }
+        }
+        send_to(session.sock, {"Error: Group ", name, " does not exist!\n"});
+        return;
+    }
+
+    //the groups as they were sent to, each once, then every group keeps the message for /history and one copy goes to every recipient
+    thread_local string sent_to;
+    sent_to.clear();
+    for (auto [id, name] : names) {
+        sent_to.append(sent_to.empty() ? "" : ",").append(name);
+    }
+    MsgBuf formattedMsg = make_msg({"[", sent_to, "] ", session.username, ": ", message, "\n"});
+    for (Group* group : groups) {
+        lock_guard<mutex> lock(group->history_lock);
+        group->history.add(string_view(formattedMsg.data, formattedMsg.size));
+    }
+    groups.clear();
+    fan_out(plan.recipients, formattedMsg);
+
+    //confirm to sending client
+    send_to(session.sock, {"Message sent to groups ", sent_to, ".\n"});
+}
+
+//send the latest n messages of a group in one write
+void group_history(Session& session, Symbol group_id, string_view group_name, size_t n) { //takes the client session, group and number of messages
+
+    if (n == 0) {
+        send_to(session.sock, "Error: Usage: /history <group_name> <n>, where n is a number of messages of at least 1.\n");
+        return;
+    }
+    Group* group = find_group(group_id);
+    thread_local string reply; //keeps its capacity between calls
+    reply.clear();
+    size_t found = 0;
+    if (group) {
+        lock_guard<mutex> lock(group->history_lock);
+        found = group->history.last(n, reply);
+    }
+    if (found == 0) {
+        send_to(session.sock, {"No messages in group ", group_name, " yet.\n"});
+        return;
+    }
+    send_to(session.sock, {"Last ", to_string(found), " message(s) of group ", group_name, ":\n", reply});
+}
+
+//private messaging
+void client_message(Session& session, Symbol user, string_view name, string_view msg) {//takes the client session, client and message to send message to a specific client
+
+    //lock the mutex in shared mode using std::shared_lock, released before the delivery
+    shared_lock<shared_mutex> lock(client_mutex);
+
+    //finds the reciever session using the interned name, a user who never logged in has no id and is not online
+    auto it = clients.find(user);
+    if (it != clients.end()) {
+        Recipient dest = recipient_of(it->second->sock);
+        lock.unlock();
+        fan_out({&dest, 1}, make_msg({"[", session.username, "] ", msg}));
+    } else if (!config.store_dir.empty() && users.load()->count(name) > 0) {
+        //a known user who is offline gets the message on the next login, stored while still holding the lock so a login in between replays it
+        MsgBuf formattedMsg = make_msg({"[", session.username, "] ", msg});
+        MsgBuf ack = make_msg({"User ", name, " is offline, the message will be delivered when they log in.\n"});
+        bool stored = store_message(name, string_view(formattedMsg.data, formattedMsg.size), Recipient{session.sock, session.epoch}, ack);
+        lock.unlock();
+        if (!stored) {
+            send_to(session.sock, {"Error: The message for ", name, " could not be stored!\n"});
+        }
+    } else {
+        lock.unlock();
+        log_event(LogLevel::Info, LogEvent::UserNotFound, name);
+        send_to(session.sock, {"Error: User ", name, " not found!"});
+    }
+}
+
+//broadcast message
+void broadcast_message(Session& session, string_view msg) {//takes the client session and message to broadcast the message to all clients except the sender
+
+    MsgBuf formattedMsg = make_msg({"[Broadcast from ", session.username, "] ", msg});
+
+    //with event loops every loop broadcasts to its own logged in clients
+    if (!event_loops.empty()) {
+        uint64_t loggedIn = 0;
+        for (const MetricStripe& stripe : metric_stripes) {
+            loggedIn += stripe.logins.load(memory_order_relaxed) - stripe.logouts.load(memory_order_relaxed);
+        }
+        metrics().fanout.record(loggedIn > 0 ? loggedIn - 1 : 0);
+        for (auto& loop : event_loops) {
+            EventLoop* target = loop.get();
+            if (target != current_loop) {
+                target->post_broadcast(formattedMsg, session.sock);
+                continue;
+            }
+            for (const auto& entry : target->sessions) {
+                if (entry.second->state == LoginState::LoggedIn && entry.first != session.sock) {
+                    target->enqueue(*entry.second, formattedMsg);
+                }
+            }
+        }
+        return;
+    }
+
+    //lock the mutex in shared mode using std::shared_lock
+    shared_lock<shared_mutex> lock(client_mutex);
+
+    //broadcasts the message to all clients except the sender, walking the bitset of their sockets instead of the clients map
+    thread_local vector<Recipient> everyone;
+    everyone.clear();
+    online_socks.for_each([&](int sock) {
+        if (sock != session.sock) {
+            everyone.push_back(recipient_of(sock));
+        }
+    });
+    lock.unlock();
+    fan_out(everyone, formattedMsg);
+}
+
+//how the arguments after a command word are split
+enum class ArgShape {
+    None, //anything after the word is ignored
+    Name, //the rest of the line is a name
+    Text, //the rest of the line is a message
+    NameText, //a name up to the next space, then the message
+    NameCount, //a name up to the next space, then an optional count
+    Page, //an optional offset and an optional limit
+};
+
+//typed arguments of a command, views into the received bytes
+struct CommandArgs {
+    string_view name; //user or group name
+    string_view text; //message text
+    Symbol id = NO_SYMBOL; //the interned name, NO_SYMBOL if no user or group of that name was ever seen
+    size_t count = 0; //NameCount: the count, config.history_messages when it is left out, 0 when it is not a number, Page: the limit, everything when left out
+    size_t offset = 0; //Page: the first entry
+};
+
+//one command of the protocol: adding a command is adding a row to commands below
+struct CommandSpec {
+    string_view name; //command word, matched exactly
+    CommandKind kind; //counter in the metrics
+    ArgShape shape;
+    bool membersOnly; //the name argument is a group the client has to be a member of
+    void (*run)(Session& session, const CommandArgs& args, bool& logout_flag);
+};
+
+constexpr CommandSpec commands[] = {
+    {"/msg", CMD_MSG, ArgShape::NameText, false, [](Session& session, const CommandArgs& args, bool&) { client_message(session, args.id, args.name, args.text); }},
+    {"/broadcast", CMD_BROADCAST, ArgShape::Text, false, [](Session& session, const CommandArgs& args, bool&) { broadcast_message(session, args.text); }},
+    {"/create_group", CMD_CREATE_GROUP, ArgShape::Name, false, [](Session& session, const CommandArgs& args, bool&) { create_group(session, args.name); }},
+    {"/join_group", CMD_JOIN_GROUP, ArgShape::Name, false, [](Session& session, const CommandArgs& args, bool&) { join_group(session, args.id, args.name); }},
+    {"/leave_group", CMD_LEAVE_GROUP, ArgShape::Name, false, [](Session& session, const CommandArgs& args, bool&) { leave_group(session, args.id, args.name); }},
+    {"/group_msg", CMD_GROUP_MSG, ArgShape::NameText, true, [](Session& session, const CommandArgs& args, bool&) { group_message(session, args.id, args.name, args.text); }},
+    {"/multi_group_msg", CMD_MULTI_GROUP_MSG, ArgShape::NameText, false, [](Session& session, const CommandArgs& args, bool&) { multi_group_message(session, args.name, args.text); }},
+    {"/history", CMD_HISTORY, ArgShape::NameCount, true, [](Session& session, const CommandArgs& args, bool&) { group_history(session, args.id, args.name, args.count); }},
+    {"/grps", CMD_GRPS, ArgShape::Page, false, [](Session& session, const CommandArgs& args, bool&) { print_groups(session, args.offset, args.count); }},
+    {"/active", CMD_ACTIVE, ArgShape::Page, false, [](Session& session, const CommandArgs& args, bool&) { print_clients(session, args.offset, args.count); }},
+    {"/logout", CMD_LOGOUT, ArgShape::None, false, [](Session&, const CommandArgs&, bool& logout_flag) { logout_flag = true; }},
+    //keepalive in both directions, any input counts as activity so the answer to a server ping only has to be understood
+    {"/ping", CMD_PING, ArgShape::None, false, [](Session& session, const CommandArgs&, bool&) { send_text(session.sock, "/pong\n"); }},
+    {"/pong", CMD_PING, ArgShape::None, false, [](Session&, const CommandArgs&, bool&) {}},
+};
+constexpr size_t command_count = sizeof(commands) / sizeof(commands[0]);
+
+//perfect hash of the command words: FNV-1a with a seed that the compiler searches for, so that no two commands share a slot
+constexpr uint32_t command_hash_step(uint32_t h, char c) {
+    return (h ^ (uint8_t)c) * 16777619u;
+}
+
+constexpr uint32_t command_hash(string_view word, uint32_t seed) {
+    uint32_t h = 2166136261u ^ seed;
+    for (char c : word) {
+        h = command_hash_step(h, c);
+    }
+    return h % COMMAND_SLOTS;
+}
+
+constexpr uint32_t find_command_seed() {
+    for (uint32_t seed = 0; seed < 4096; seed++) {
+        bool used[COMMAND_SLOTS] = {};
+        bool perfect = true;
+        for (const CommandSpec& command : commands) {
+            uint32_t slot = command_hash(command.name, seed);
+            perfect = perfect && !used[slot];
+            used[slot] = true;
+        }
+        if (perfect) {
+            return seed;
+        }
+    }
+    return UINT32_MAX;
+}
+constexpr uint32_t command_seed = find_command_seed();
+static_assert(command_seed != UINT32_MAX, "no collision free seed for the command table, raise COMMAND_SLOTS");
+
+//slot > index into commands, -1 for an empty slot
+constexpr array<int8_t, COMMAND_SLOTS> command_slots = [] {
+    array<int8_t, COMMAND_SLOTS> slots{};
+    slots.fill(-1);
+    for (size_t i = 0; i < command_count; i++) {
+        slots[command_hash(commands[i].name, command_seed)] = (int8_t)i;
+    }
+    return slots;
+}();
+
+//the command named by the first word of a message, nullptr if there is none, end is set to where the word ends
+//the word ends at the first space (or line end) and is hashed in the same pass that looks for its end
+const CommandSpec* find_command(string_view message, size_t& end) {
+    uint32_t h = 2166136261u ^ command_seed;
+    end = 0;
+    while (end < message.size() && message[end] != ' ' && message[end] != '\r' && message[end] != '\n') {
+        h = command_hash_step(h, message[end++]);
+    }
+    int8_t i = command_slots[h % COMMAND_SLOTS];
+    if (i < 0 || commands[i].name.size() != end || memcmp(commands[i].name.data(), message.data(), end) != 0) {
+        return nullptr;
+    }
+    return &commands[i];
+}
+
+//split the arguments after a command word as the command expects them, false if some are missing
+bool parse_command_args(ArgShape shape, string_view rest, bool hasArgs, CommandArgs& args) {
+    if (shape == ArgShape::None) {
+        return true;
+    }
+    if (shape == ArgShape::Page) {
+        //"/active", "/active 100" or "/active 100 50", anything unreadable counts as left out
+        args.count = SIZE_MAX;
+        const char* end = rest.data() + rest.size();
+        auto [next, ec] = from_chars(rest.data(), end, args.offset);
+        if (ec == errc() && next < end && *next == ' ') {
+            from_chars(next + 1, end, args.count);
+        }
+        if (args.count == 0) {
+            args.count = SIZE_MAX;
+        }
+        return true;
+    }
+    if (!hasArgs) {
+        return false;
+    }
+    size_t space = rest.find(' ');
+    switch (shape) {
+    case ArgShape::Name:
+        args.name = rest;
+        return true;
+    case ArgShape::Text:
+        args.text = rest;
+        return true;
+    case ArgShape::NameText:
+        if (space == string_view::npos) {
+            return false;
+        }
+        args.name = rest.substr(0, space);
+        args.text = rest.substr(space + 1);
+        return true;
+    case ArgShape::NameCount:
+        args.name = rest.substr(0, space);
+        args.count = config.history_messages; // all kept messages by default
+        if (space != string_view::npos && space + 1 < rest.size()) {
+            const char* end = rest.data() + rest.size();
+            auto [next, ec] = from_chars(rest.data() + space + 1, end, args.count);
+            if (ec != errc() || next != end) {
+                args.count = 0;
+            }
+        }
+        return true;
+    default:
+        return false;
+    }
+}
+
+//take a token from the client's bucket for this kind of command and from its bucket for all commands, false if either is empty
+//the buckets belong to the session and are only used by its own thread or strand, so no lock is needed
+bool take_token(Session& session, CommandKind kind) {
+    if (kind == CMD_LOGOUT) {
+        return true; //leaving is never limited
+    }
+    uint64_t now = now_ns();
+    TokenBucket& own = session.buckets[kind];
+    TokenBucket& all = session.buckets[CMD_KINDS];
+    bool allowed = own.refill(config.rate_limits[kind], now);
+    allowed = all.refill(config.rate_limits[CMD_KINDS], now) && allowed;
+    if (!allowed) {
+        return false;
+    }
+    own.tokens--;
+    all.tokens--;
+    return true;
+}
+
+//process the message sent by the client, the arguments are views into the received bytes
+void process_message(string_view message, Session& session, bool& logout_flag){ //takes the message and client session to process the message depending on the command
+
+    //the arguments follow the space after the command word
+    size_t end;
+    const CommandSpec* command = find_command(message, end);
+    if (command == nullptr) {
+        count(metrics().commands[CMD_UNKNOWN]);
+        return;
+    }
+    bool hasArgs = end < message.size() && message[end] == ' ';
+    string_view rest = hasArgs ? message.substr(end + 1) : string_view();
+    count(metrics().commands[command->kind]);
+    if (!take_token(session, command->kind)) {
+        count(metrics().rate_limited);
+        send_to(session.sock, {"Error: Rate limit exceeded for ", command->name, ", try again later.\n"});
+        return;
+    }
+    CommandArgs args;
+    if (!parse_command_args(command->shape, rest, hasArgs, args)) {
+        return;
+    }
+    //the one lookup of the name, the handlers find clients and groups by id
+    if (!args.name.empty() && command->kind != CMD_CREATE_GROUP && command->kind != CMD_MULTI_GROUP_MSG) {
+        args.id = symbols.find(args.name);
+    }
+
+    // Only members can write to or read a group, only the client's own thread changes its memberships
+    if (command->membersOnly && !session.member_of(args.id)) {
+        send_to(session.sock, {"Error: You are not a member of the group ", args.name, ".\n"});
+        return;
+    }
+    command->run(session, args, logout_flag);
+}
+
+const char* loginPrompt = "Welcome to Wazzapp\n\nEnter the username: ";
+const char* welcomeMsg = "Welcome to the chat server!\n\nTo broadcast the message to all online users type /broadcast <message>\nTo send message to a specific online client type /msg <username> <message>\nTo send message to a specific group type /group_msg <group_name> <message>\nTo send one message to several groups type /multi_group_msg <group1>,<group2>,... <message>\nTo see the latest messages of a group type /history <group_name> <n>\nTo create a new group type /create group <group name>\nTo join an existing group type /join group <group name>\nTo leave a group type /leave group <group name>\nTo get a list of all active users type /active (or /active <offset> <limit> for a page of it)\nTo get a list of all groups type /grps (or /grps <offset> <limit>)\n\nTo log out type /logout\n\nType /exit for closing the session\n\nEnjoy your time here!\n ";
+
+//read a users file (one username:password per line) into a new credential index, returns nullptr if it can not be opened
+shared_ptr<const UserIndex> load_users(const string& path) {
+    ifstream in(path);
+    if (!in) {
+        return nullptr;
+    }
+    auto index = make_shared<UserIndex>();
+    string line;
+    while (getline(in, line)) {
+        size_t colon = line.find(':');
+        if (colon == string::npos || colon == 0) {
+            continue; //not a credential line
+        }
+        (*index)[line.substr(0, colon)] = line.substr(colon + 1);
+    }
+    return index;
+}
+
+//watch the users file and swap in a fresh index whenever it is rewritten, replaced or created
+void watch_users(string path) {
+    int fd = inotify_init1(IN_CLOEXEC);
+    if (fd == -1) {
+        log_text(LogLevel::Warn, "inotify unavailable, " + path + " will not be reloaded");
+        return;
+    }
+    //watch the directory, editors usually replace the file instead of writing it in place
+    size_t slash = path.rfind('/');
+    string dir = slash == string::npos ? "." : path.substr(0, slash + 1);
+    string name = slash == string::npos ? path : path.substr(slash + 1);
+    if (inotify_add_watch(fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) == -1) {
+        log_text(LogLevel::Warn, "can not watch " + dir + ", " + path + " will not be reloaded");
+        close(fd);
+        return;
+    }
+
+    alignas(inotify_event) char buffer[4096];
+    while (true) {
+        ssize_t len = read(fd, buffer, sizeof(buffer));
+        if (len <= 0) {
+            if (len == -1 && errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        bool changed = false;
+        for (char* p = buffer; p < buffer + len; ) {
+            auto* event = reinterpret_cast<inotify_event*>(p);
+            if (event->len > 0 && name == event->name) {
+                changed = true;
+            }
+            p += sizeof(inotify_event) + event->len;
+        }
+        if (!changed) {
+            continue;
+        }
+        auto index = load_users(path);
+        if (index) {
+            users.store(index);
+            log_text(LogLevel::Info, "Reloaded " + to_string(index->size()) + " users from " + path);
+        }
+    }
+    close(fd);
+}
+
+//check the credential index for authentication, readers never wait for a reload
+//a users file entry in crypt(3) format ("$id$..."), as written by --hash-users, rather than a plain password
+bool is_password_hash(string_view stored) {
+    return stored.size() > 3 && stored[0] == '$' && count(stored.begin(), stored.end(), '$') >= 3;
+}
+
+//true if a plain password in the users file matches, for a hashed entry the hash is copied into hash for the verifier instead
+bool check_credentials(const string& username, string_view password, string& hash) {
+    shared_ptr<const UserIndex> index = users.load();
+    if (!index) {
+        return false;
+    }
+    auto it = index->find(username);
+    if (it == index->end()) {
+        return false;
+    }
+    if (is_password_hash(it->second)) {
+        hash = it->second;
+        return false;
+    }
+    return it->second == password;
+}
+
+//hash a password with the salt and parameters of hash and compare, in constant time, the memory-hard part runs here
+bool verify_password(const string& hash, const string& password) {
+    thread_local unique_ptr<crypt_data> data = make_unique<crypt_data>();
+    const char* computed = crypt_rn(password.c_str(), hash.c_str(), data.get(), sizeof(crypt_data));
+    if (computed == nullptr || computed[0] == '*' || strlen(computed) != hash.size()) {
+        return false;
+    }
+    unsigned char diff = 0;
+    for (size_t i = 0; i < hash.size(); i++) {
+        diff |= (unsigned char)(computed[i] ^ hash[i]);
+    }
+    return diff == 0;
+}
+
+//fixed pool of threads checking password hashes: a memory-hard hash takes milliseconds and megabytes, so it neither runs on
+//an event loop, where every other client would wait for it, nor on as many threads at once as there are clients logging in
+struct Verifier {
+    mutex lock;
+    condition_variable wake;
+    deque<function<void()>> jobs;
+
+    explicit Verifier(int threads) {
+        for (int i = 0; i < threads; i++) {
+            thread([this] { run(); }).detach();
+        }
+    }
+
+    void submit(function<void()> job) {
+        {
+            lock_guard<mutex> guard(lock);
+            jobs.push_back(move(job));
+        }
+        wake.notify_one();
+    }
+
+    //check on a verifier thread and wait for the result, for the thread mode where the client's own thread can wait
+    bool check(const string& hash, string_view password) {
+        promise<bool> result;
+        future<bool> done = result.get_future();
+        submit([&] { result.set_value(verify_password(hash, string(password))); });
+        return done.get();
+    }
+
+    void run() {
+        while (true) {
+            function<void()> job;
+            {
+                unique_lock<mutex> guard(lock);
+                wake.wait(guard, [this] { return !jobs.empty(); });
+                job = move(jobs.front());
+                jobs.pop_front();
+            }
+            job();
+        }
+    }
+};
+unique_ptr<Verifier> verifier; //nullptr until main starts it
+
+//--hash-users: print a users file with every plain password replaced by a salted yescrypt hash, on verify_threads threads
+int hash_users_file(const string& path) {
+    ifstream in(path);
+    if (!in) {
+        cerr << "Error: Can not open " << path << endl;
+        return 1;
+    }
+    vector<string> lines;
+    for (string line; getline(in, line);) {
+        lines.push_back(move(line));
+    }
+    atomic<size_t> next{0};
+    atomic<bool> failed{false};
+    vector<thread> threads;
+    for (int t = 0; t < config.verify_threads; t++) {
+        threads.emplace_back([&] {
+            crypt_data data{};
+            char salt[CRYPT_GENSALT_OUTPUT_SIZE];
+            for (size_t i = next++; i < lines.size(); i = next++) {
+                size_t colon = lines[i].find(':');
+                if (colon == string::npos || colon == 0 || is_password_hash(string_view(lines[i]).substr(colon + 1))) {
+                    continue; //not a credential line, or hashed already
+                }
+                string password = lines[i].substr(colon + 1);
+                const char* hash = nullptr;
+                if (crypt_gensalt_rn("$y$", config.hash_cost, nullptr, 0, salt, sizeof(salt)) != nullptr) {
+                    hash = crypt_rn(password.c_str(), salt, &data, sizeof(data));
+                }
+                if (hash == nullptr || hash[0] == '*') {
+                    failed = true;
+                    return;
+                }
+                lines[i].replace(colon + 1, string::npos, hash);
+            }
+        });
+    }
+    for (thread& t : threads) {
+        t.join();
+    }
+    if (failed) {
+        cerr << "Error: Can not hash with yescrypt at cost " << config.hash_cost << endl;
+        return 1;
+    }
+    for (const string& line : lines) {
+        cout << line << "\n";
+    }
+    return 0;
+}
+
+//failed logins of a username in the current window of --login-throttle
+struct LoginFailures {
+    int count = 0;
+    uint64_t window_start = 0; //now_ns() of the first failure of the window
+};
+//the usernames are spread over shards, so logins of different users rarely wait for each other
+struct alignas(64) ThrottleShard {
+    mutex lock;
+    NameMap<LoginFailures> failures;
+};
+ThrottleShard throttle_shards[THROTTLE_SHARDS];
+
+ThrottleShard& throttle_shard_of(string_view username) {
+    return throttle_shards[NameHash{}(username) % THROTTLE_SHARDS];
+}
+
+//true while a username has had --login-throttle failed logins within the current window
+bool login_throttled(string_view username) {
+    if (config.login_throttle <= 0) {
+        return false;
+    }
+    ThrottleShard& shard = throttle_shard_of(username);
+    lock_guard<mutex> lock(shard.lock);
+    auto it = shard.failures.find(username);
+    if (it == shard.failures.end()) {
+        return false;
+    }
+    if (now_ns() - it->second.window_start > (uint64_t)config.login_window * 1000000000ull) {
+        shard.failures.erase(it);
+        return false;
+    }
+    return it->second.count >= config.login_throttle;
+}
+
+//count a failed login for a username, windows that are over are swept out as the shard grows
+void record_login_failure(string_view username) {
+    if (config.login_throttle <= 0) {
+        return;
+    }
+    uint64_t now = now_ns();
+    uint64_t window = (uint64_t)config.login_window * 1000000000ull;
+    ThrottleShard& shard = throttle_shard_of(username);
+    lock_guard<mutex> lock(shard.lock);
+    if (shard.failures.size() >= 1024) {
+        erase_if(shard.failures, [&](const auto& entry) { return now - entry.second.window_start > window; });
+    }
+    auto it = shard.failures.find(username);
+    if (it == shard.failures.end()) {
+        it = shard.failures.emplace(username, LoginFailures{}).first;
+    }
+    if (it->second.count == 0 || now - it->second.window_start > window) {
+        it->second = {0, now};
+    }
+    it->second.count++;
+}
+
+//a successful login forgets the failures before it
+void clear_login_failures(string_view username) {
+    if (config.login_throttle <= 0) {
+        return;
+    }
+    ThrottleShard& shard = throttle_shard_of(username);
+    lock_guard<mutex> lock(shard.lock);
+    auto it = shard.failures.find(username);
+    if (it != shard.failures.end()) {
+        shard.failures.erase(it);
+    }
+}
+
+atomic<bool> shutting_down{false}; //SIGTERM or SIGINT: every client is being closed
+
+//remove a logged in client from clients and from its groups, used on logout and on disconnect
+void remove_client(Session& session) {
+    count(metrics().logouts);
+
+    {
+        lock_guard<shared_mutex> lock(client_mutex);
+        auto it = clients.find(session.user);
+        if (it != clients.end() && it->second == &session) {
+            clients.erase(it);
+            online_socks.erase(session.sock);
+            clients_version++;
+        }
+    }
+
+    //a group left empty is deleted like on /leave_group, every group is locked on its own
+    vector<pair<MsgBuf, vector<Recipient>>> notices;
+    for (Symbol group_id : session.groups) {
+        Group* group = find_group(group_id);
+        if (!group) {
+            continue;
+        }
+        vector<Recipient> members;
+        {
+            lock_guard<shared_mutex> lock(group->lock);
+            group->remove(&session);
+            groups_version++;
+            if (group->members.empty()) {
+                group->retire();
+                continue;
+            }
+            members.reserve(group->members.size());
+            for (const Member& member : group->members) {
+                members.push_back(member.conn);
+            }
+        }
+        notices.emplace_back(make_msg({session.username, " has left the group ", symbols.name(group_id), ".\n"}), move(members));
+    }
+    session.groups.clear();
+
+    //on shutdown the other members are being closed as well, they are not told
+    if (shutting_down.load()) {
+        return;
+    }
+    for (const auto& notice : notices) {
+        fan_out(notice.second, notice.first);
+    }
+}
+
+//the password of a session was checked: log it in, or count the failure and prompt again, returns false if the connection has to be closed
+bool finish_login(Session& session, bool ok, bool throttled, uint64_t loginStart) {
+    if (ok) {
+        //the username is claimed under the exclusive lock, the replies go out after it is released
+        bool claimed;
+        {
+            //a user whose password checks out is interned, names that never logged in do not fill the table
+            session.user = symbols.intern(session.username);
+            lock_guard<shared_mutex> lock(client_mutex);
+            claimed = session.user != NO_SYMBOL && clients.emplace(session.user, &session).second;
+            if (claimed) {
+                online_socks.insert(session.sock);
+                clients_version++;
+            }
+        }
+
+        //another session may have logged in with the same username while the password was checked
+        if (!claimed) {
+            send_text(session.sock, "Error: Client already connected! Log out from previous session to connect.\n");
+            send_text(session.sock, loginPrompt);
+            session.state = LoginState::AwaitUsername;
+            return true;
+        }
+
+        // The client is in the map of clients, send the welcome message
+        count(metrics().logins);
+        metrics().login_ns.record(now_ns() - loginStart);
+        clear_login_failures(session.username);
+        send_text(session.sock, welcomeMsg);
+        session.state = LoginState::LoggedIn;
+        replay_stored(session);
+        return true;
+    }
+
+    if (throttled) {
+        //the password is not even checked, guessing is not worth it while the username is locked
+        count(metrics().logins_throttled);
+        send_text(session.sock, "Error: Too many failed logins for this user, try again later.\n\n");
+    } else {
+        count(metrics().login_failures);
+        metrics().login_ns.record(now_ns() - loginStart);
+        record_login_failure(session.username);
+        if (config.login_attempts > 0) {
+            send_to(session.sock, {"Error: Wrong credentials! You have ", to_string(config.login_attempts), " total login attempts\n\n"});
+        } else {
+            send_text(session.sock, "Error: Wrong credentials!\n\n");
+        }
+    }
+    session.loginAttempts++;
+    if (config.login_attempts > 0 && session.loginAttempts >= config.login_attempts) {
+        send_text(session.sock, "Error: Too many failed login attempts. Authentication failed.\n");
+        return false;
+    }
+    send_text(session.sock, loginPrompt);
+    session.state = LoginState::AwaitUsername;
+    return true;
+}
+
+bool handle_input(Session& session, string_view input);
+bool resume_login(Session& session, bool ok);
+
+//hand a hashed password to the verifier, the result comes back to the session's event loop (and on to its strand)
+void verify_async(Session& session, string hash, string_view password, uint64_t loginStart) {
+    session.state = LoginState::Verifying;
+    session.verify_started = loginStart;
+    EventLoop* loop = session.loop;
+    int sock = session.sock;
+    uint32_t epoch = socket_slots[sock].epoch.load();
+    verifier->submit([loop, sock, epoch, hash = move(hash), password = string(password)] {
+        bool ok = verify_password(hash, password);
+        loop->post([loop, sock, epoch, ok] {
+            //the client may have left while its password was checked
+            SocketSlot& slot = socket_slots[sock];
+            if (slot.epoch.load() != epoch || slot.session == nullptr) {
+                return;
+            }
+            if (executor) {
+                executor->resume(*slot.session, ok);
+            } else if (!resume_login(*slot.session, ok)) {
+                loop->drop_session(sock);
+            }
+        });
+    });
+}
+
+//the verifier is done with a session's password: finish the login, then handle the input held meanwhile
+bool resume_login(Session& session, bool ok) {
+    if (session.state != LoginState::Verifying) {
+        return true;
+    }
+    bool keep_open = finish_login(session, ok, false, session.verify_started);
+    string held;
+    held.swap(session.held_input);
+    for (size_t at = 0; at < held.size() && keep_open;) {
+        uint32_t len;
+        memcpy(&len, held.data() + at, sizeof(len));
+        keep_open = handle_input(session, string_view(held.data() + at + sizeof(len), len));
+        at += sizeof(len) + len;
+    }
+    return keep_open;
+}
+
+//feed one message received from the client into its login/command state machine, returns false if the connection has to be closed
+bool handle_input(Session& session, string_view input) {
+    switch (session.state) {
+    case LoginState::AwaitUsername: {
+        session.username = input;
+
+        // Check if the username is already in use by another client and send a message to the client
+        bool connected;
+        {
+            shared_lock<shared_mutex> lock(client_mutex);
+            connected = clients.find(symbols.find(session.username)) != clients.end();
+        }
+        if (connected) {
+            send_text(session.sock, "Error: Client already connected! Log out from previous session to connect.\n");
+            send_text(session.sock, loginPrompt);
+            return true;
+        }
+
+        // Ask the client for password
+        send_text(session.sock, "Enter the password: ");
+        session.state = LoginState::AwaitPassword;
+        return true;
+    }
+
+    case LoginState::AwaitPassword: {
+        uint64_t loginStart = now_ns();
+        bool throttled = login_throttled(session.username);
+        bool ok = false;
+        if (!throttled) {
+            string hash;
+            ok = check_credentials(session.username, input, hash);
+            if (!hash.empty() && verifier && session.loop != nullptr) {
+                verify_async(session, move(hash), input, loginStart);
+                return true;
+            }
+            if (!hash.empty()) {
+                //thread mode: the client's own thread waits, the number of hashes computed at once stays bounded
+                ok = verifier ? verifier->check(hash, input) : verify_password(hash, string(input));
+            }
+        }
+        return finish_login(session, ok, throttled, loginStart);
+    }
+
+    case LoginState::Verifying: {
+        //whatever the client sends before its password is checked is handled after the check
+        if (session.held_input.size() + input.size() > 65536) {
+            return false;
+        }
+        uint32_t len = (uint32_t)input.size();
+        session.held_input.append((const char*)&len, sizeof(len));
+        session.held_input.append(input);
+        return true;
+    }
+
+    case LoginState::LoggedIn: {
+        //Display any message sent by the client
+        log_event(LogLevel::Info, LogEvent::Message, session.username, input);
+
+        //Pass the message into the process_message
+        bool logout_flag = false;
+        uint64_t commandStart = now_ns();
+        process_message(input, session, logout_flag);
+        metrics().command_ns.record(now_ns() - commandStart);
+
+        //on logout the same socket goes back to the login prompt
+        if (logout_flag) {
+            remove_client(session);
+            session.state = LoginState::AwaitUsername;
+            session.loginAttempts = 0;
+            session.login_started.store(now_ns(), memory_order_relaxed);
+            send_text(session.sock, loginPrompt);
+        }
+        return true;
+    }
+    }
+    return false;
+}
+
+atomic<int> open_connections{0}; //accepted and not closed yet
+
+//admission control right after accept: with --max-connections open already the new connection is told and closed at once,
+//before any thread, event loop or session is spent on it, returns false if it was refused
+bool admit_connection(int sock) {
+    if (open_connections.fetch_add(1) >= config.max_connections && config.max_connections > 0) {
+        open_connections--;
+        count(metrics().connections_rejected);
+        const char* full = "Error: The server is full, try again later.\n";
+        send(sock, full, strlen(full), MSG_DONTWAIT | MSG_NOSIGNAL);
+        close(sock);
+        return false;
+    }
+    return true;
+}
+
+//start tracking an accepted socket, returns false if the socket number does not fit the socket table
+bool open_socket(int sock, EventLoop* loop) {
+    if (sock >= socket_slot_count) {
+        open_connections--;
+        close(sock);
+        return false;
+    }
+    socket_slots[sock].loop.store(loop);
+    count(metrics().connections);
+    return true;
+}
+
+//clean up after a client that disconnected or has to be disconnected, and close its socket
+void close_session(Session& session) {
+    if (session.state == LoginState::LoggedIn) {
+        log_event(LogLevel::Info, LogEvent::Disconnected, session.username);
+        remove_client(session);
+    }
+    count(metrics().disconnects);
+    SocketSlot& slot = socket_slots[session.sock];
+    lock_guard<mutex> lock(slot.write_mutex);
+    slot.epoch++;
+    slot.loop.store(nullptr);
+    close(session.sock);
+    open_connections--;
+}
+
+//handle a received message right away, or queue it on the session's strand when workers run the commands
+bool dispatch_input(Session& session, string_view input) {
+    if (executor && session.loop != nullptr) {
+        executor->input(session, input);
+        return true;
+    }
+    return handle_input(session, input);
+}
+
+//handle every complete frame received so far, returns false if the connection has to be closed
+bool handle_frames(Session& session) {
+    bool keep_open = true;
+    size_t used = 0;
+    string_view pending = session.input.pending();
+    session.frame_missing = 0;
+    while (keep_open) {
+        uint64_t len;
+        int lenBytes = get_varint(pending.data() + used, pending.size() - used, len);
+        if (lenBytes == 0) {
+            break; //length not complete yet
+        }
+        if (lenBytes < 0 || len == 0 || len > config.max_frame) {
+            keep_open = false; //not a valid frame, the stream can not be resynchronized
+            break;
+        }
+        size_t available = pending.size() - used - lenBytes;
+        if (available < len) {
+            session.frame_missing = len - available;
+            break;
+        }
+        uint8_t opcode = pending[used + lenBytes];
+        string_view payload = pending.substr(used + lenBytes + 1, len - 1);
+        used += lenBytes + len;
+        if (opcode == OP_TEXT) {
+            keep_open = dispatch_input(session, payload);
+        } else {
+            keep_open = false; //unknown opcode
+        }
+    }
+    session.input.consume(used);
+    return keep_open;
+}
+
+//handle bytes received from the client elsewhere (io_uring), returns false if the connection has to be closed
+bool handle_received(Session& session, const char* data, size_t n) {
+    session.last_active.store(now_ns(), memory_order_relaxed);
+    if (config.protocol == Protocol::Text) {
+        return dispatch_input(session, string_view(data, n)); //every receive is one message
+    }
+    memcpy(session.input.tail(n), data, n);
+    session.input.commit(n);
+    return handle_frames(session);
+}
+
+//receive once from the client and handle what arrived, returns the recv result and clears keep_open if the connection has to be closed
+ssize_t receive_input(Session& session, int flags, bool& keep_open) {
+    if (config.protocol == Protocol::Text) {
+        //every recv is one message
+        char buffer[BUFFER_SIZE];
+        ssize_t bytesReceived = recv(session.sock, buffer, BUFFER_SIZE, flags);
+        if (bytesReceived > 0) {
+            keep_open = handle_received(session, buffer, bytesReceived);
+        }
+        return bytesReceived;
+    }
+
+    //framed: a single recv may bring many frames or only part of one, large frames are received in as few calls as possible
+    size_t want = max<size_t>(READ_CHUNK, session.frame_missing);
+    char* tail = session.input.tail(want);
+    ssize_t bytesReceived = recv(session.sock, tail, want, flags);
+    if (bytesReceived > 0) {
+        session.last_active.store(now_ns(), memory_order_relaxed);
+        session.input.commit(bytesReceived);
+        keep_open = handle_frames(session);
+    }
+    return bytesReceived;
+}
+
+uint64_t seconds_ns(int seconds) {
+    return (uint64_t)seconds * 1000000000ull;
+}
+
+//look at a connection whose timer went off: returns 0 if its login or idle time is up, otherwise pings it if it has been
+//quiet for too long and returns when to look again (UINT64_MAX: never), the notice or ping is sent with send
+//only the timer changes the timer's state, activity just stores a timestamp, so a busy client costs the timer nothing
+template <typename Send>
+uint64_t review_timeouts(Session& session, uint64_t now, Send send) {
+    uint64_t active = session.last_active.load(memory_order_relaxed);
+    bool loggedIn = session.state == LoginState::LoggedIn;
+    uint64_t next = UINT64_MAX;
+    if (!loggedIn && config.login_timeout > 0) {
+        uint64_t deadline = session.login_started.load(memory_order_relaxed) + seconds_ns(config.login_timeout);
+        if (now >= deadline) {
+            count(metrics().login_timeouts);
+            send("Error: Login timed out.\n");
+            return 0;
+        }
+        next = deadline;
+    }
+    if (config.idle_timeout > 0) {
+        uint64_t deadline = active + seconds_ns(config.idle_timeout);
+        if (now >= deadline) {
+            count(metrics().idle_disconnects);
+            send("Error: Idle for too long, disconnecting.\n");
+            return 0;
+        }
+        next = min(next, deadline);
+    }
+    if (loggedIn && config.ping_interval > 0) {
+        uint64_t due = max(active, session.pinged) + seconds_ns(config.ping_interval);
+        if (now >= due) {
+            count(metrics().pings_sent);
+            send("/ping\n");
+            session.pinged = now;
+            due = now + seconds_ns(config.ping_interval);
+        }
+        next = min(next, due);
+    }
+    return next;
+}
+
+//start the timeouts of a new connection, returns when its timer first goes off (UINT64_MAX: never)
+uint64_t start_timeouts(Session& session) {
+    uint64_t now = now_ns();
+    session.last_active.store(now, memory_order_relaxed);
+    session.login_started.store(now, memory_order_relaxed);
+    session.timer.session = &session;
+    uint64_t next = UINT64_MAX;
+    if (config.login_timeout > 0) {
+        next = now + seconds_ns(config.login_timeout);
+    }
+    if (config.idle_timeout > 0) {
+        next = min(next, now + seconds_ns(config.idle_timeout));
+    }
+    if (config.ping_interval > 0) {
+        next = min(next, now + seconds_ns(config.ping_interval));
+    }
+    return next;
+}
+
+//hot restart: the state of the server travels to the new process as varints and length prefixed strings
+struct StateWriter {
+    string out;
+
+    void number(uint64_t value) {
+        uint8_t bytes[10];
+        out.append((const char*)bytes, put_varint(bytes, value));
+    }
+
+    void text(string_view s) {
+        number(s.size());
+        out.append(s);
+    }
+};
+
+//reads what a StateWriter wrote, ok is cleared for good once the input runs short or is malformed
+struct StateReader {
+    string_view in;
+    bool ok = true;
+
+    uint64_t number() {
+        uint64_t value = 0;
+        int used = get_varint(in.data(), in.size(), value);
+        if (used <= 0) {
+            ok = false;
+            return 0;
+        }
+        in.remove_prefix(used);
+        return value;
+    }
+
+    string_view text() {
+        uint64_t len = number();
+        if (len > in.size()) {
+            ok = false;
+            return {};
+        }
+        string_view s = in.substr(0, len);
+        in.remove_prefix(len);
+        return s;
+    }
+};
+
+//a connection as the new process gets it, its socket comes separately
+struct SessionImage {
+    LoginState state = LoginState::AwaitUsername;
+    int loginAttempts = 0;
+    string username;
+    vector<string> groups; //names of the groups it is a member of
+    string input; //received, not parsed into frames yet
+    string output; //not written yet, frame headers included
+};
+
+//write what the new process needs of a connection: its login, its groups and its unfinished input and output
+//password checks and commands in progress are finished before, rate limits and timeouts start over
+void save_session(StateWriter& w, Session& session) {
+    w.number((uint64_t)session.state.load());
+    w.number(session.loginAttempts);
+    w.text(session.username);
+    w.number(session.groups.size());
+    for (Symbol group_id : session.groups) {
+        w.text(symbols.name(group_id));
+    }
+    w.text(session.input.pending());
+
+    //io_uring: the rest of a send cut short by the handoff comes first, then the queue
+    string output;
+    if (session.batch && session.batch->entries > 0) {
+        const msghdr& mh = session.batch->mh;
+        for (size_t i = 0; i < mh.msg_iovlen; i++) {
+            output.append((const char*)mh.msg_iov[i].iov_base, mh.msg_iov[i].iov_len);
+        }
+    }
+    for (size_t i = 0; i < session.out.count; i++) {
+        OutEntry& e = session.out.at(i);
+        string_view header((const char*)e.header, e.headerLen);
+        string_view body(e.body.data, e.body.size);
+        output.append(header.substr(min(e.sent, header.size())));
+        output.append(body.substr(e.sent > header.size() ? e.sent - header.size() : 0));
+    }
+    w.text(output);
+}
+
+//read a connection written by save_session, false if the state is damaged
+bool read_session(StateReader& r, SessionImage& image) {
+    image.state = (LoginState)r.number();
+    image.loginAttempts = (int)r.number();
+    image.username = r.text();
+    uint64_t groups = r.number();
+    for (uint64_t i = 0; i < groups && r.ok; i++) {
+        image.groups.emplace_back(r.text());
+    }
+    image.input = r.text();
+    image.output = r.text();
+    return r.ok && image.state != LoginState::Verifying && image.state <= LoginState::LoggedIn;
+}
+
+//serve a handed over connection as it was: a logged in client stays logged in, without a password check, and in its groups
+void restore_session(Session& session, const SessionImage& image) {
+    session.state = image.state;
+    session.loginAttempts = image.loginAttempts;
+    session.username = image.username;
+    if (!image.input.empty()) {
+        memcpy(session.input.tail(image.input.size()), image.input.data(), image.input.size());
+        session.input.commit(image.input.size());
+    }
+    if (!image.output.empty()) {
+        session.out.push_raw(make_msg(image.output));
+    }
+    if (image.state != LoginState::LoggedIn) {
+        return;
+    }
+    session.user = symbols.intern(session.username);
+    {
+        lock_guard<shared_mutex> lock(client_mutex);
+        if (session.user == NO_SYMBOL || !clients.emplace(session.user, &session).second) {
+            session.state = LoginState::AwaitUsername; //a damaged state, the client logs in again
+            return;
+        }
+        online_socks.insert(session.sock);
+        clients_version++;
+    }
+    for (const string& name : image.groups) {
+        Symbol group_id = symbols.find(name);
+        Group* group = find_group(group_id);
+        if (!group) {
+            continue;
+        }
+        lock_guard<shared_mutex> lock(group->lock);
+        group->add(&session);
+        groups_version++;
+        session.join(group_id);
+    }
+}
+
+//thread mode: one thread runs the timers of every connection, the client threads just sit in recv
+mutex timer_mutex; //protects thread_timers, held while a timer runs so its session can not go away meanwhile
+TimerWheel thread_timers;
+
+//thread mode: the client threads, so that a shutdown can close their clients and a hot restart can stop them
+struct ClientThreads {
+    mutex lock;
+    condition_variable changed; //a thread parked or ended, or the threads may carry on
+    unordered_set<Session*> sessions; //sessions of the running threads
+    int running = 0; //threads started and not ended, counted before they start
+    int parked = 0; //threads waiting in park_client
+    atomic<bool> frozen{false}; //a hot restart is handing the clients over
+};
+ClientThreads client_threads;
+
+//SIGUSR1 only has to end a client thread's recv with EINTR, which it does because the handler has no SA_RESTART
+void interrupt_client(int) {
+}
+
+//a client thread waits here, between two messages, while a hot restart has the clients stopped
+void park_client() {
+    if (!client_threads.frozen.load()) {
+        return;
+    }
+    unique_lock<mutex> lock(client_threads.lock);
+    client_threads.parked++;
+    client_threads.changed.notify_all();
+    client_threads.changed.wait(lock, [] { return !client_threads.frozen.load(); });
+    client_threads.parked--;
+}
+
+//write a notice or ping only if the socket takes all of it right away, the timer thread never waits for a client
+bool try_send_text(int sock, const char* msg) {
+    SocketSlot& slot = socket_slots[sock];
+    unique_lock<mutex> lock(slot.write_mutex, try_to_lock);
+    if (!lock.owns_lock()) {
+        return true; //another thread is writing to the client, it is not idle on our side
+    }
+    uint8_t header[11];
+    size_t len = strlen(msg);
+    size_t headerLen = frame_header(header, len);
+    iovec iov[2] = {{header, headerLen}, {(void*)msg, len}};
+    msghdr mh{};
+    mh.msg_iov = iov;
+    mh.msg_iovlen = 2;
+    ssize_t written = sendmsg(sock, &mh, MSG_DONTWAIT | MSG_NOSIGNAL);
+    return written == (ssize_t)(headerLen + len) || (written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK));
+}
+
+void run_thread_timers() {
+    while (true) {
+        this_thread::sleep_for(chrono::milliseconds(TIMER_TICK_MS));
+        lock_guard<mutex> lock(timer_mutex);
+        if (client_threads.frozen.load()) {
+            continue; //nothing may change while the clients are handed over
+        }
+        uint64_t now = now_ns();
+        thread_timers.advance(now, [now](TimerNode& node) {
+            Session& session = *node.session;
+            bool intact = true;
+            uint64_t next = review_timeouts(session, now, [&](const char* msg) { intact = try_send_text(session.sock, msg); });
+            if (next == 0 || !intact) {
+                //recv returns 0 and the client's thread cleans up as if the client had left
+                shutdown(session.sock, SHUT_RDWR);
+            } else if (next != UINT64_MAX) {
+                thread_timers.schedule(node, next);
+            }
+        });
+    }
+}
+
+//Define a function to handle each client by assigning each of them a thread for communication
+//the thread owns the session, restored sessions were handed over by a hot restart and are not prompted to log in
+void clientHandler(Session* client, bool restored) {
+    unique_ptr<Session> owner(client);
+    Session& session = *client;
+    int clientSocket = session.sock;
+    {
+        lock_guard<mutex> lock(client_threads.lock);
+        session.thread = pthread_self();
+        client_threads.sessions.insert(&session);
+    }
+    uint64_t firstTimeout = start_timeouts(session);
+    if (firstTimeout != UINT64_MAX) {
+        lock_guard<mutex> lock(timer_mutex);
+        thread_timers.schedule(session.timer, firstTimeout);
+    }
+    if (!restored) {
+        send_text(clientSocket, loginPrompt);
+    } else if (session.out.count > 0) {
+        //output the old process had not written yet goes out before anything else
+        lock_guard<mutex> lock(socket_slots[clientSocket].write_mutex);
+        while (session.out.count > 0) {
+            iovec iov = {(void*)session.out.at(0).body.data, session.out.at(0).body.size};
+            send_all(clientSocket, &iov, 1);
+            session.out.pop();
+        }
+    }
+
+    bool keep_open = !shutting_down.load();
+    while (keep_open) {
+        park_client();
+        //Continue listening to messages from client without termination
+        ssize_t bytesReceived = receive_input(session, 0, keep_open);
+        if (bytesReceived < 0 && errno == EINTR) {
+            continue; //a hot restart is stopping the client threads
+        }
+        //Check if the client has disconnected
+        if (bytesReceived <= 0) {
+            break;
+        }
+    }
+    {
+        //the socket number must not be shut down by the timer once it is closed and handed to a new client
+        lock_guard<mutex> lock(timer_mutex);
+        thread_timers.cancel(session.timer);
+    }
+    {
+        lock_guard<mutex> lock(client_threads.lock);
+        client_threads.sessions.erase(&session);
+    }
+    close_session(session);
+
+    //only now, logging out touched the clients and groups a hot restart hands over
+    lock_guard<mutex> lock(client_threads.lock);
+    client_threads.running--;
+    client_threads.changed.notify_all();
+}
+
+//thread mode: serve a client on a thread of its own, counted before it starts so that a hot restart waits for it
+void start_client_thread(Session* session, bool restored) {
+    {
+        lock_guard<mutex> lock(client_threads.lock);
+        client_threads.running++;
+    }
+    thread(clientHandler, session, restored).detach();
+}
+
+Executor::Executor(int workers) {
+    for (int i = 0; i < workers; i++) {
+        queues.push_back(make_unique<Queue>());
+    }
+    for (int i = 0; i < workers; i++) {
+        thread([this, i] { run(i); }).detach();
+    }
+}
+
+//queue a received message on the session's strand, runs on the session's event loop
+void Executor::input(Session& session, string_view msg) {
+    uint32_t len = (uint32_t)msg.size();
+    unique_lock<mutex> lock(session.strand_mutex);
+    session.strand_input.append((const char*)&len, sizeof(len));
+    session.strand_input.append(msg);
+    if (!session.strand_scheduled) {
+        session.strand_scheduled = true;
+        lock.unlock();
+        submit(&session);
+    }
+}
+
+//verdicts of the verifier travel on the strand between the messages, as a length no message can have
+constexpr uint32_t STRAND_REJECTED = UINT32_MAX - 1;
+constexpr uint32_t STRAND_ACCEPTED = UINT32_MAX;
+
+//queue the verifier's verdict on a session's password on its strand, runs on the session's event loop
+void Executor::resume(Session& session, bool ok) {
+    uint32_t verdict = ok ? STRAND_ACCEPTED : STRAND_REJECTED;
+    unique_lock<mutex> lock(session.strand_mutex);
+    session.strand_input.append((const char*)&verdict, sizeof(verdict));
+    if (!session.strand_scheduled) {
+        session.strand_scheduled = true;
+        lock.unlock();
+        submit(&session);
+    }
+}
+
+//the event loop let go of a session, its strand owns it from now on and closes it once its input is handled
+void Executor::close(Session* session) {
+    unique_lock<mutex> lock(session->strand_mutex);
+    session->strand_closed = true;
+    if (!session->strand_scheduled) {
+        session->strand_scheduled = true;
+        lock.unlock();
+        submit(session);
+    }
+}
+
+//queue a strand, a worker keeps strands it resubmits on its own queue, event loops spread theirs round robin
+void Executor::submit(Session* session) {
+    size_t i = current_worker != SIZE_MAX ? current_worker : next.fetch_add(1, memory_order_relaxed) % queues.size();
+    {
+        lock_guard<mutex> lock(queues[i]->lock);
+        queues[i]->strands.push_back(session);
+    }
+    queued.fetch_add(1);
+    if (sleeping.load() > 0) {
+        lock_guard<mutex> lock(idle_lock);
+        wake.notify_one();
+    }
+}
+
+//the next strand for worker self: the newest of its own queue, else the oldest of another worker's queue
+Session* Executor::take(size_t self) {
+    for (size_t k = 0; k < queues.size(); k++) {
+        Queue& q = *queues[(self + k) % queues.size()];
+        lock_guard<mutex> lock(q.lock);
+        if (!q.strands.empty()) {
+            Session* session;
+            if (k == 0) {
+                session = q.strands.back();
+                q.strands.pop_back();
+            } else {
+                session = q.strands.front();
+                q.strands.pop_front();
+            }
+            queued.fetch_sub(1);
+            return session;
+        }
+    }
+    return nullptr;
+}
+
+//handle the input a session got so far, then queue it again if more arrived, or close it if the connection is gone
+void Executor::run_strand(Session* session) {
+    thread_local string batch; //swapped with the session's input, both keep their capacity
+    {
+        lock_guard<mutex> lock(session->strand_mutex);
+        batch.swap(session->strand_input);
+    }
+    for (size_t at = 0; at < batch.size();) {
+        uint32_t len;
+        memcpy(&len, batch.data() + at, sizeof(len));
+        bool verdict = len >= STRAND_REJECTED;
+        string_view msg(batch.data() + at + sizeof(len), verdict ? 0 : len);
+        at += sizeof(len) + msg.size();
+        if (session->strand_failed) {
+            continue;
+        }
+        if (verdict ? !resume_login(*session, len == STRAND_ACCEPTED) : !handle_input(*session, msg)) {
+            //the event loop closes the connection, which closes the strand in turn
+            session->strand_failed = true;
+            EventLoop* loop = session->loop;
+            int sock = session->sock;
+            uint32_t epoch = socket_slots[sock].epoch.load();
+            loop->post([loop, sock, epoch] {
+                if (socket_slots[sock].epoch.load() == epoch && socket_slots[sock].session != nullptr) {
+                    loop->drop_session(sock);
+                }
+            });
+        }
+    }
+    batch.clear();
+
+    unique_lock<mutex> lock(session->strand_mutex);
+    if (!session->strand_input.empty()) {
+        lock.unlock();
+        submit(session); //behind the strands already queued, so a busy client does not starve the others
+    } else if (session->strand_closed) {
+        lock.unlock();
+        close_session(*session);
+        delete session;
+    } else {
+        session->strand_scheduled = false;
+    }
+}
+
+void Executor::run(size_t self) {
+    current_worker = self;
+    while (true) {
+        Session* session = take(self);
+        if (session != nullptr) {
+            run_strand(session);
+            continue;
+        }
+        unique_lock<mutex> lock(idle_lock);
+        sleeping.fetch_add(1);
+        wake.wait(lock, [this] { return queued.load() > 0; });
+        sleeping.fetch_sub(1);
+    }
+}
+
+EventLoop::EventLoop() : index(event_loops.size()) { //constructed right before it is appended to event_loops
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (epfd == -1 || wakefd == -1) {
+        cerr << "Error: Can not create event loop\n" << endl;
+        exit(5);
+    }
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.fd = wakefd;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, wakefd, &ev);
+    if (config.mode == ServerMode::Uring) {
+        ring = make_unique<Uring>();
+        if (!ring->init(config.protocol == Protocol::Text ? BUFFER_SIZE : READ_CHUNK)) {
+            cerr << "Error: Can not set up io_uring for an event loop\n" << endl;
+            exit(5);
+        }
+    }
+}
+
+//run a task on the loop thread
+void EventLoop::post(function<void()> task) {
+    {
+        lock_guard<mutex> lock(inbox_mutex);
+        inbox.push_back(move(task));
+    }
+    uint64_t one = 1;
+    write(wakefd, &one, sizeof(one));
+}
+
+//hand messages for clients of this loop over to the loop thread
+void EventLoop::post(span<const Recipient> recipients, const MsgBuf& msg) {
+    {
+        lock_guard<mutex> lock(inbox_mutex);
+        for (const Recipient& r : recipients) {
+            deliveries.push_back({r, msg});
+        }
+    }
+    uint64_t one = 1;
+    write(wakefd, &one, sizeof(one));
+}
+
+//start watching an opened socket and give it a session, nullptr if it could not be watched, runs on the loop thread
+Session* EventLoop::start_session(int sock) {
+    auto session = make_unique<Session>();
+    session->sock = sock;
+    session->epoch = socket_slots[sock].epoch.load();
+    session->loop = this;
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+    if (config.zerocopy > 0) {
+        int on = 1;
+        setsockopt(sock, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on));
+    }
+
+    //edge-triggered, the socket is read until EAGAIN and written until EAGAIN or an empty queue on every notification
+    epoll_event ev{};
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.fd = sock;
+    if (ring) {
+        arm_recv(*session); //io_uring: one multishot receive for the life of the connection
+    } else if (epoll_ctl(epfd, EPOLL_CTL_ADD, sock, &ev) == -1) {
+        close_session(*session);
+        return nullptr;
+    }
+    socket_slots[sock].session = session.get();
+    uint64_t firstTimeout = start_timeouts(*session);
+    if (firstTimeout != UINT64_MAX) {
+        timers.schedule(session->timer, firstTimeout);
+    }
+    Session* started = session.get();
+    sessions[sock] = move(session);
+    return started;
+}
+
+//start serving a newly accepted client, runs on the loop thread
+void EventLoop::add_session(int sock) {
+    if (open_socket(sock, this) && start_session(sock) != nullptr) {
+        send_text(sock, loginPrompt);
+    }
+}
+
+//serve a client handed over by a hot restart as it was in the old process, runs before the loop thread starts
+void EventLoop::adopt_session(int sock, const SessionImage& image) {
+    if (!open_socket(sock, this)) {
+        return;
+    }
+    Session* session = start_session(sock);
+    if (session == nullptr) {
+        return;
+    }
+    restore_session(*session, image);
+    if (session->out.count > 0) {
+        session->dirty = true;
+        dirty.push_back(sock);
+    }
+}
+
+//stop watching a client and close it, whatever the socket still takes of its queued output is written first
+void EventLoop::drop_session(int sock) {
+    auto it = sessions.find(sock);
+    if (it == sessions.end()) {
+        return;
+    }
+    Session& session = *it->second;
+    if (session.draining) {
+        return;
+    }
+    session.closing = true;
+    timers.cancel(session.timer);
+    if (ring) {
+        //the kernel may still hold the receive and a send, the session goes once both have completed, the shutdown ends them
+        //output queued behind a send in flight is lost, everything else is written first like with epoll
+        session.draining = true;
+        socket_slots[sock].session = nullptr;
+        if (!session.sending) {
+            flush(session);
+        }
+        shutdown(sock, SHUT_RDWR);
+        finish_drain(sock);
+        return;
+    }
+    flush(session);
+    epoll_ctl(epfd, EPOLL_CTL_DEL, sock, nullptr);
+    socket_slots[sock].session = nullptr;
+    if (executor) {
+        //commands of the session may still be queued or running, its strand logs it out and closes it after them
+        executor->close(it->second.release());
+        sessions.erase(it);
+        return;
+    }
+    close_session(session);
+    sessions.erase(it);
+}
+
+//close a session once the current iteration is done, used where sessions are being walked or written to
+void EventLoop::schedule_close(Session& session) {
+    if (!session.closing) {
+        session.closing = true;
+        doomed.push_back(session.sock);
+    }
+}
+
+//queue a message for a client of this loop, it is written by flush_pending at the end of the current iteration
+void EventLoop::enqueue(Session& session, const MsgBuf& msg) {
+    if (session.closing) {
+        return;
+    }
+    uint8_t header[11];
+    size_t len = frame_header(header, msg.size) + msg.size;
+    MetricStripe& m = metrics();
+    if (session.out.fits(len)) {
+        session.out.push(msg);
+    } else if (config.backpressure == Backpressure::Drop) {
+        session.out.dropped++;
+        count(m.messages_dropped);
+        return;
+    } else if (config.backpressure == Backpressure::Disconnect) {
+        count(m.slow_disconnects);
+        schedule_close(session);
+        return;
+    } else {
+        size_t dropped = session.out.dropped;
+        session.out.coalesce(msg);
+        count(m.messages_dropped, session.out.dropped - dropped);
+    }
+    count(m.messages_sent);
+    m.queue_depth.record(session.out.count);
+    if (!session.dirty) {
+        session.dirty = true;
+        dirty.push_back(session.sock);
+    }
+}
+
+//write queued output with writev until the queue is empty or the socket is full, returns false on a write error
+bool EventLoop::flush(Session& session) {
+    OutboundQueue& q = session.out;
+    bool zerocopyFailed = false;
+    while (q.count > 0) {
+        //a large message goes out on its own with MSG_ZEROCOPY, everything else is gathered into one call
+        auto large = [&](const OutEntry& e) { return config.zerocopy > 0 && !zerocopyFailed && e.body.size >= config.zerocopy; };
+        bool zerocopy = large(q.at(0));
+        iovec iov[64];
+        int n = 0;
+        for (size_t i = 0; i < q.count && n + 2 <= 64; i++) {
+            OutEntry& e = q.at(i);
+            if (i > 0 && (zerocopy || large(e))) {
+                break;
+            }
+            size_t skip = e.sent;
+            if (skip < e.headerLen) {
+                iov[n++] = {e.header + skip, e.headerLen - skip};
+                //the header lives in the queue slot which is reused, only the shared body may be pinned by the kernel
+                if (zerocopy) {
+                    zerocopy = false;
+                    break;
+                }
+                skip = 0;
+            } else {
+                skip -= e.headerLen;
+            }
+            if (skip < e.body.size) {
+                iov[n++] = {(void*)(e.body.data + skip), e.body.size - skip};
+            }
+        }
+        msghdr mh{};
+        mh.msg_iov = iov;
+        mh.msg_iovlen = n;
+        ssize_t written = sendmsg(session.sock, &mh, zerocopy ? MSG_ZEROCOPY : 0);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (zerocopy && errno == ENOBUFS) {
+                zerocopyFailed = true; //out of pinned memory, copy this time
+                continue;
+            }
+            //EAGAIN: the rest goes out on the next EPOLLOUT edge
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        //the kernel reads the pages later, the message stays alive until it reports completion
+        if (zerocopy) {
+            session.zerocopy_pending.emplace_back(session.zerocopy_next++, q.at(0).body);
+        }
+        q.consume(written);
+    }
+    return true;
+}
+
+//release the messages the kernel has finished sending with MSG_ZEROCOPY, it reports them on the error queue
+void EventLoop::reap_zerocopy(Session& session) {
+    while (!session.zerocopy_pending.empty()) {
+        char control[128];
+        msghdr mh{};
+        mh.msg_control = control;
+        mh.msg_controllen = sizeof(control);
+        if (recvmsg(session.sock, &mh, MSG_ERRQUEUE) == -1) {
+            return; //nothing left on the error queue
+        }
+        for (cmsghdr* cm = CMSG_FIRSTHDR(&mh); cm != nullptr; cm = CMSG_NXTHDR(&mh, cm)) {
+            bool recverr = (cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) || (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR);
+            if (!recverr) {
+                continue;
+            }
+            auto* err = reinterpret_cast<sock_extended_err*>(CMSG_DATA(cm));
+            if (err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                continue;
+            }
+            //sends [ee_info, ee_data] are complete, ids wrap around
+            uint32_t last = err->ee_data;
+            while (!session.zerocopy_pending.empty() && (int32_t)(session.zerocopy_pending.front().first - last) <= 0) {
+                session.zerocopy_pending.pop_front();
+            }
+        }
+    }
+}
+
+//flush every session that got output during this iteration, then close the sessions that have to go
+//a frozen loop keeps them for the handoff, or for after the thaw
+void EventLoop::flush_pending() {
+    if (phase == LoopPhase::Frozen) {
+        return;
+    }
+    while (!dirty.empty() || !doomed.empty()) {
+        flushing.swap(dirty);
+        for (int sock : flushing) {
+            Session* session = socket_slots[sock].session;
+            if (session == nullptr || !session->dirty) {
+                continue;
+            }
+            session->dirty = false;
+            if (ring) {
+                submit_send(*session); //goes out with the next io_uring_enter, together with the sends of every other session
+            } else if (!flush(*session)) {
+                schedule_close(*session);
+            }
+        }
+        flushing.clear();
+        flushing.swap(doomed);
+        for (int sock : flushing) {
+            //the socket number may already belong to a new client if the session went away in the meantime
+            Session* session = socket_slots[sock].session;
+            if (session != nullptr && session->closing) {
+                drop_session(sock);
+            }
+        }
+        flushing.clear();
+    }
+}
+
+//accept every pending connection on the loop's own listening socket
+void EventLoop::accept_clients() {
+    while (true) {
+        int sock = accept4(listenfd, nullptr, nullptr, SOCK_CLOEXEC | SOCK_NONBLOCK);
+        if (sock == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            return; //EAGAIN, or out of descriptors until some client leaves
+        }
+        if (admit_connection(sock)) {
+            add_session(sock);
+        }
+    }
+}
+
+//read everything the client has sent so far
+void EventLoop::on_readable(int sock) {
+    auto it = sessions.find(sock);
+    if (it == sessions.end()) {
+        return;
+    }
+    Session& session = *it->second;
+    while (true) {
+        bool keep_open = true;
+        ssize_t bytesReceived = receive_input(session, MSG_DONTWAIT, keep_open);
+        if (!keep_open) {
+            drop_session(sock);
+            return;
+        }
+        if (bytesReceived > 0) {
+            continue;
+        }
+        if (bytesReceived < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytesReceived < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+        drop_session(sock); //orderly shutdown or error
+        return;
+    }
+}
+
+//a timer of the loop went off: ping the session, close it, or schedule the timer again
+void EventLoop::on_timer(Session& session, uint64_t now) {
+    if (session.closing) {
+        return;
+    }
+    uint64_t next = review_timeouts(session, now, [&](const char* msg) { send_text(session.sock, msg); });
+    if (next == 0) {
+        schedule_close(session); //the notice is flushed first
+    } else if (next != UINT64_MAX) {
+        timers.schedule(session.timer, next);
+    }
+}
+
+//hand a broadcast over to the loop thread, every logged in client of the loop but except gets it
+void EventLoop::post_broadcast(const MsgBuf& msg, int except) {
+    {
+        lock_guard<mutex> lock(inbox_mutex);
+        deliveries.push_back({{-1, 0}, msg, except});
+    }
+    uint64_t one = 1;
+    write(wakefd, &one, sizeof(one));
+}
+
+//run the tasks and queue the messages posted by other threads
+void EventLoop::run_inbox() {
+    uint64_t count;
+    while (read(wakefd, &count, sizeof(count)) > 0) {
+    }
+    {
+        lock_guard<mutex> lock(inbox_mutex);
+        running.swap(inbox);
+        delivering.swap(deliveries);
+    }
+    for (auto& task : running) {
+        task();
+    }
+    running.clear();
+    for (const Delivery& d : delivering) {
+        if (d.to.sock != -1) {
+            write_to(d.to, d.msg);
+            continue;
+        }
+        for (const auto& entry : sessions) {
+            if (entry.second->state == LoginState::LoggedIn && entry.first != d.except) {
+                enqueue(*entry.second, d.msg);
+            }
+        }
+    }
+    delivering.clear();
+}
+
+//start the multishot accept of the loop's own listening socket
+void EventLoop::arm_accept() {
+    io_uring_sqe* e = ring->sqe();
+    e->opcode = IORING_OP_ACCEPT;
+    e->fd = listenfd;
+    e->ioprio = IORING_ACCEPT_MULTISHOT;
+    e->accept_flags = SOCK_CLOEXEC | SOCK_NONBLOCK;
+    e->user_data = uring_data(URING_ACCEPT, 0);
+    accept_armed = true;
+}
+
+//start the multishot receive of a session, it delivers every arrival into a provided buffer until it ends
+//not while the loop is frozen or closing, a thaw starts it again
+void EventLoop::arm_recv(Session& session) {
+    if (phase != LoopPhase::Serving) {
+        return;
+    }
+    io_uring_sqe* e = ring->sqe();
+    e->opcode = IORING_OP_RECV;
+    e->fd = session.sock;
+    e->ioprio = IORING_RECV_MULTISHOT;
+    e->flags = IOSQE_BUFFER_SELECT;
+    e->buf_group = 0;
+    e->user_data = uring_data(URING_RECV, session.sock);
+    session.recv_armed = true;
+}
+
+//hand the front of a session's outbound queue to the kernel as one sendmsg, at most one is in flight per session
+//the rest of a partial send goes out before anything else of the session
+void EventLoop::submit_send(Session& session) {
+    if (session.sending || phase == LoopPhase::Frozen) {
+        return;
+    }
+    if (session.batch && session.batch->entries > 0) {
+        io_uring_sqe* e = ring->sqe();
+        e->opcode = IORING_OP_SENDMSG;
+        e->fd = session.sock;
+        e->addr = (uint64_t)&session.batch->mh;
+        e->msg_flags = MSG_NOSIGNAL;
+        e->user_data = uring_data(URING_SEND, session.sock);
+        session.sending = true;
+        return;
+    }
+    if (session.out.count == 0) {
+        return;
+    }
+    if (!session.batch) {
+        session.batch = make_unique<SendBatch>();
+    }
+    SendBatch& b = *session.batch;
+    OutboundQueue& q = session.out;
+    int n = 0;
+    while (q.count > 0 && b.entries < SendBatch::ENTRIES) {
+        OutEntry& e = q.at(0);
+        size_t skip = e.sent;
+        memcpy(b.headers[b.entries], e.header, e.headerLen);
+        if (skip < e.headerLen) {
+            b.iov[n++] = {b.headers[b.entries] + skip, e.headerLen - skip};
+            skip = 0;
+        } else {
+            skip -= e.headerLen;
+        }
+        if (skip < e.body.size) {
+            b.iov[n++] = {(void*)(e.body.data + skip), e.body.size - skip};
+        }
+        b.bodies[b.entries++] = e.body;
+        q.pop();
+    }
+    b.mh = msghdr{};
+    b.mh.msg_iov = b.iov;
+    b.mh.msg_iovlen = n;
+    submit_send(session);
+}
+
+//ask the kernel to end an accept, receive or send in flight, it completes with -ECANCELED unless it was done already
+void EventLoop::cancel(UringOp op, int sock) {
+    io_uring_sqe* e = ring->sqe();
+    e->opcode = IORING_OP_ASYNC_CANCEL;
+    e->addr = uring_data(op, sock);
+    e->user_data = uring_data(URING_CANCEL, sock);
+}
+
+//free a dropped session once the kernel has nothing of it left
+void EventLoop::finish_drain(int sock) {
+    auto it = sessions.find(sock);
+    if (it == sessions.end() || !it->second->draining || it->second->recv_armed || it->second->sending) {
+        return;
+    }
+    if (executor) {
+        executor->close(it->second.release());
+    } else {
+        close_session(*it->second);
+    }
+    sessions.erase(it);
+}
+
+void EventLoop::on_completion(const io_uring_cqe& cqe) {
+    UringOp op = (UringOp)(cqe.user_data >> 32);
+    int sock = (int)(uint32_t)cqe.user_data;
+    bool more = cqe.flags & IORING_CQE_F_MORE;
+    if (op == URING_CANCEL) {
+        return; //what was cancelled completes on its own
+    }
+    if (op == URING_WAKE) {
+        run_inbox();
+        if (!more) {
+            io_uring_sqe* e = ring->sqe();
+            e->opcode = IORING_OP_POLL_ADD;
+            e->fd = wakefd;
+            e->poll32_events = POLLIN;
+            e->len = IORING_POLL_ADD_MULTI;
+            e->user_data = uring_data(URING_WAKE, 0);
+        }
+        return;
+    }
+    if (op == URING_ACCEPT) {
+        if (cqe.res >= 0 && admit_connection(cqe.res)) {
+            add_session(cqe.res);
+        }
+        accept_armed = more;
+        if (!more && phase == LoopPhase::Serving) {
+            arm_accept();
+        }
+        return;
+    }
+
+    auto it = sessions.find(sock);
+    if (op == URING_RECV) {
+        //0 is the orderly shutdown, a receive cancelled by a handoff or a shutdown leaves the connection as it is
+        bool keep_open = cqe.res > 0 || cqe.res == -ENOBUFS || (cqe.res == -ECANCELED && phase != LoopPhase::Serving);
+        if (cqe.flags & IORING_CQE_F_BUFFER) {
+            uint16_t bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+            if (it != sessions.end() && !it->second->draining && cqe.res > 0) {
+                keep_open = handle_received(*it->second, ring->buffer_memory + bid * ring->buffer_size, cqe.res);
+            }
+            ring->recycle(bid);
+        }
+        if (it == sessions.end()) {
+            return;
+        }
+        Session& session = *it->second;
+        if (!more) {
+            session.recv_armed = false;
+        }
+        if (session.draining) {
+            finish_drain(sock);
+        } else if (!keep_open) {
+            drop_session(sock);
+        } else if (!more && phase == LoopPhase::Serving) {
+            //the kernel ended the receive, out of buffers when many clients send at once: read what is waiting like epoll would
+            if (cqe.res == -ENOBUFS) {
+                on_readable(sock);
+                it = sessions.find(sock);
+                if (it == sessions.end() || it->second->draining) {
+                    return;
+                }
+            }
+            arm_recv(*it->second);
+        }
+        return;
+    }
+
+    //URING_SEND: the rest of a partial send goes out before anything else of the session
+    if (it == sessions.end()) {
+        return;
+    }
+    Session& session = *it->second;
+    SendBatch& b = *session.batch;
+    session.sending = false;
+    if (cqe.res == -ECANCELED && phase == LoopPhase::Frozen && !session.draining) {
+        return; //the batch is handed over, or sent after the thaw
+    }
+    if (cqe.res > 0 && !session.draining) {
+        size_t n = cqe.res;
+        while (b.mh.msg_iovlen > 0 && n >= b.mh.msg_iov->iov_len) {
+            n -= b.mh.msg_iov->iov_len;
+            b.mh.msg_iov++;
+            b.mh.msg_iovlen--;
+        }
+        if (b.mh.msg_iovlen > 0) {
+            b.mh.msg_iov->iov_base = (char*)b.mh.msg_iov->iov_base + n;
+            b.mh.msg_iov->iov_len -= n;
+            submit_send(session);
+            return;
+        }
+    }
+    for (int i = 0; i < b.entries; i++) {
+        b.bodies[i] = MsgBuf();
+    }
+    b.entries = 0;
+    if (session.draining) {
+        finish_drain(sock);
+    } else if (cqe.res < 0) {
+        schedule_close(session);
+    } else {
+        submit_send(session);
+    }
+}
+
+//the io_uring counterpart of run: completions instead of readiness, and one io_uring_enter per iteration submits every
+//send, receive and accept queued during the previous one and waits for the next completions
+void EventLoop::run_uring() {
+    current_loop = this;
+    io_uring_sqe* e = ring->sqe();
+    e->opcode = IORING_OP_POLL_ADD;
+    e->fd = wakefd;
+    e->poll32_events = POLLIN;
+    e->len = IORING_POLL_ADD_MULTI;
+    e->user_data = uring_data(URING_WAKE, 0);
+    if (listenfd != -1) {
+        arm_accept();
+    }
+    while (phase != LoopPhase::Stopped) {
+        //only a serving loop times its clients out
+        int waitMs = phase == LoopPhase::Serving ? timers.wait_ms(now_ns()) : -1;
+        ring->enter(1, waitMs);
+        ring->reap([this](const io_uring_cqe& cqe) { on_completion(cqe); });
+        if (phase == LoopPhase::Serving) {
+            uint64_t now = now_ns();
+            timers.advance(now, [&](TimerNode& node) { on_timer(*node.session, now); });
+        }
+        flush_pending();
+        if (phase == LoopPhase::Closing) {
+            close_finished();
+        }
+    }
+}
+
+void EventLoop::run() {
+    if (ring) {
+        run_uring();
+        return;
+    }
+    current_loop = this;
+    epoll_event events[MAX_EVENTS];
+    while (phase != LoopPhase::Stopped) {
+        int n = epoll_wait(epfd, events, MAX_EVENTS, phase == LoopPhase::Serving ? timers.wait_ms(now_ns()) : -1);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_text(LogLevel::Error, "epoll_wait failed");
+            return;
+        }
+        for (int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+            if (fd == wakefd) {
+                run_inbox();
+            } else if (fd == listenfd) {
+                if (phase == LoopPhase::Serving) {
+                    accept_clients();
+                }
+            } else if (phase != LoopPhase::Frozen) {
+                //MSG_ZEROCOPY completions arrive as socket errors
+                if (events[i].events & EPOLLERR) {
+                    Session* session = socket_slots[fd].session;
+                    if (session != nullptr) {
+                        reap_zerocopy(*session);
+                    }
+                }
+                //the socket has room again, write what is still queued
+                if (events[i].events & EPOLLOUT) {
+                    Session* session = socket_slots[fd].session;
+                    if (session != nullptr && !session->closing && !flush(*session)) {
+                        schedule_close(*session);
+                    }
+                }
+                if ((events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) && phase == LoopPhase::Serving) {
+                    on_readable(fd);
+                }
+            }
+        }
+        if (phase == LoopPhase::Serving) {
+            uint64_t now = now_ns();
+            timers.advance(now, [&](TimerNode& node) { on_timer(*node.session, now); });
+        }
+        flush_pending();
+        if (phase == LoopPhase::Closing) {
+            close_finished();
+        }
+    }
+}
+
+//nothing the client sent is still being handled: no password check, and no command queued or running on a worker
+bool EventLoop::settled(Session& session) {
+    if (session.state == LoginState::Verifying) {
+        return false;
+    }
+    if (executor) {
+        lock_guard<mutex> lock(session.strand_mutex);
+        return !session.strand_scheduled;
+    }
+    return true;
+}
+
+//hot restart: stop reading, writing and timing out the clients, io_uring operations in flight are cancelled
+//replies to what the clients sent before are still queued, quiet tells when nothing is left in flight
+void EventLoop::freeze() {
+    phase = LoopPhase::Frozen;
+    if (!ring) {
+        return;
+    }
+    if (accept_armed) {
+        cancel(URING_ACCEPT, 0);
+    }
+    for (auto& entry : sessions) {
+        Session& session = *entry.second;
+        if (session.draining) {
+            continue;
+        }
+        if (session.recv_armed) {
+            cancel(URING_RECV, entry.first);
+        }
+        if (session.sending) {
+            cancel(URING_SEND, entry.first);
+        }
+    }
+}
+
+//frozen and settled: the kernel holds no accept, receive or send of the loop and no client has input being handled
+bool EventLoop::quiet() {
+    if (accept_armed) {
+        return false;
+    }
+    for (auto& entry : sessions) {
+        Session& session = *entry.second;
+        if (session.recv_armed || session.sending || !settled(session)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+//the handoff failed, serve the clients again: what arrived meanwhile is read and what was queued is written
+void EventLoop::thaw() {
+    phase = LoopPhase::Serving;
+    if (listenfd != -1) {
+        if (!ring) {
+            accept_clients();
+        } else if (!accept_armed) {
+            arm_accept();
+        }
+    }
+    vector<int> socks;
+    for (auto& entry : sessions) {
+        socks.push_back(entry.first);
+    }
+    for (int sock : socks) {
+        Session* session = socket_slots[sock].session;
+        if (session == nullptr || session->closing) {
+            continue;
+        }
+        if (!ring) {
+            on_readable(sock); //edges that came while frozen were ignored
+            session = socket_slots[sock].session;
+            if (session == nullptr || session->closing) {
+                continue;
+            }
+        } else if (!session->recv_armed) {
+            arm_recv(*session);
+        }
+        if (!session->dirty && (session->out.count > 0 || (session->batch && session->batch->entries > 0))) {
+            session->dirty = true;
+            dirty.push_back(sock);
+        }
+    }
+}
+
+//hot restart: write the state of the loop's clients and collect their sockets in the same order, on the frozen loop
+//clients on their way out are left behind and close with this process
+void EventLoop::save_sessions(StateWriter& out, vector<int>& socks) {
+    for (auto& entry : sessions) {
+        Session& session = *entry.second;
+        if (!session.closing) {
+            save_session(out, session);
+            socks.push_back(entry.first);
+        }
+    }
+}
+
+//shutdown: stop accepting and reading, every client gets the notice and is closed by close_finished once it is written
+void EventLoop::begin_close(const MsgBuf& notice) {
+    phase = LoopPhase::Closing;
+    if (listenfd != -1) {
+        if (!ring) {
+            epoll_ctl(epfd, EPOLL_CTL_DEL, listenfd, nullptr);
+        } else if (accept_armed) {
+            cancel(URING_ACCEPT, 0);
+        }
+        close(listenfd);
+        listenfd = -1;
+    }
+    for (auto& entry : sessions) {
+        Session& session = *entry.second;
+        if (ring && session.recv_armed && !session.draining) {
+            cancel(URING_RECV, entry.first);
+        }
+        enqueue(session, notice);
+    }
+}
+
+//shutdown: close the clients whose output is written and whose input is handled, the loop ends after its last client
+void EventLoop::close_finished() {
+    vector<int> finished;
+    for (auto& entry : sessions) {
+        Session& session = *entry.second;
+        if (!session.closing && !session.sending && session.out.count == 0 && settled(session)) {
+            finished.push_back(entry.first);
+        }
+    }
+    for (int sock : finished) {
+        drop_session(sock);
+    }
+    if (sessions.empty()) {
+        phase = LoopPhase::Stopped;
+    }
+}
+
+//whether this kernel runs everything the io_uring backend uses: a ring with a provided buffer ring, and a multishot
+//receive that keeps going after its first completion (6.0 and later), tried out on a socket pair
+bool uring_supported() {
+    Uring probe;
+    int sv[2];
+    if (!probe.init(64) || socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == -1) {
+        return false;
+    }
+    io_uring_sqe* e = probe.sqe();
+    e->opcode = IORING_OP_RECV;
+    e->fd = sv[0];
+    e->ioprio = IORING_RECV_MULTISHOT;
+    e->flags = IOSQE_BUFFER_SELECT;
+    bool multishot = false;
+    bool ended = false;
+    (void)!write(sv[1], "x", 1);
+    for (int i = 0; i < 20 && !ended; i++) {
+        probe.enter(1, 100);
+        probe.reap([&](const io_uring_cqe& cqe) {
+            multishot = multishot || (cqe.res == 1 && (cqe.flags & IORING_CQE_F_MORE));
+            ended = !(cqe.flags & IORING_CQE_F_MORE);
+        });
+        if (multishot) {
+            shutdown(sv[0], SHUT_RDWR); //ends the receive
+        }
+    }
+    close(sv[0]);
+    close(sv[1]);
+    return multishot && ended;
+}
+
+//sum of one histogram over every stripe
+struct HistogramTotals {
+    uint64_t buckets[HISTOGRAM_BUCKETS] = {};
+    uint64_t sum = 0;
+    uint64_t count = 0;
+};
+
+HistogramTotals total_of(Histogram MetricStripe::* histogram) {
+    HistogramTotals totals;
+    for (const MetricStripe& stripe : metric_stripes) {
+        const Histogram& h = stripe.*histogram;
+        for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+            uint64_t n = h.buckets[i].load(memory_order_relaxed);
+            totals.buckets[i] += n;
+            totals.count += n;
+        }
+        totals.sum += h.sum.load(memory_order_relaxed);
+    }
+    return totals;
+}
+
+uint64_t total_of(atomic<uint64_t> MetricStripe::* counter) {
+    uint64_t total = 0;
+    for (const MetricStripe& stripe : metric_stripes) {
+        total += (stripe.*counter).load(memory_order_relaxed);
+    }
+    return total;
+}
+
+//write one metric family in Prometheus text format, histograms get a bucket for every bucket boundary from minValue to maxValue
+void write_counter(ostream& out, const char* name, const char* help, uint64_t value, const char* type = "counter") {
+    out << "# HELP " << name << " " << help << "\n# TYPE " << name << " " << type << "\n" << name << " " << value << "\n";
+}
+
+void write_histogram(ostream& out, const char* name, const char* help, Histogram MetricStripe::* histogram, uint64_t minValue, uint64_t maxValue, double scale) {
+    HistogramTotals totals = total_of(histogram);
+    out << "# HELP " << name << " " << help << "\n# TYPE " << name << " histogram\n";
+    uint64_t cumulative = 0;
+    for (int i = 0; i <= Histogram::index(maxValue); i++) {
+        cumulative += totals.buckets[i];
+        if (Histogram::upper(i) >= minValue) {
+            out << name << "_bucket{le=\"" << Histogram::upper(i) * scale << "\"} " << cumulative << "\n";
+        }
+    }
+    out << name << "_bucket{le=\"+Inf\"} " << totals.count << "\n";
+    out << name << "_sum " << totals.sum * scale << "\n" << name << "_count " << totals.count << "\n";
+}
+
+string render_metrics() {
+    ostringstream out;
+    uint64_t connections = total_of(&MetricStripe::connections);
+    uint64_t logins = total_of(&MetricStripe::logins);
+    write_counter(out, "wazzapp_connections_total", "Client connections accepted.", connections);
+    write_counter(out, "wazzapp_connected_clients", "Client connections currently open.", connections - total_of(&MetricStripe::disconnects), "gauge");
+    write_counter(out, "wazzapp_logins_total", "Successful logins.", logins);
+    write_counter(out, "wazzapp_login_failures_total", "Login attempts with wrong credentials.", total_of(&MetricStripe::login_failures));
+    write_counter(out, "wazzapp_logins_throttled_total", "Logins refused after too many failures for the username.", total_of(&MetricStripe::logins_throttled));
+    write_counter(out, "wazzapp_connections_rejected_total", "Connections refused because the connection limit was reached.", total_of(&MetricStripe::connections_rejected));
+    write_counter(out, "wazzapp_commands_rate_limited_total", "Commands refused by the per-client rate limits.", total_of(&MetricStripe::rate_limited));
+    write_counter(out, "wazzapp_login_timeouts_total", "Connections closed for not logging in in time.", total_of(&MetricStripe::login_timeouts));
+    write_counter(out, "wazzapp_idle_disconnects_total", "Connections closed after being idle for too long.", total_of(&MetricStripe::idle_disconnects));
+    write_counter(out, "wazzapp_pings_sent_total", "Pings sent to quiet clients.", total_of(&MetricStripe::pings_sent));
+    write_counter(out, "wazzapp_logged_in_clients", "Clients currently logged in.", logins - total_of(&MetricStripe::logouts), "gauge");
+    out << "# HELP wazzapp_commands_total Commands handled, by command.\n# TYPE wazzapp_commands_total counter\n";
+    for (int kind = 0; kind < CMD_KINDS; kind++) {
+        uint64_t total = 0;
+        for (const MetricStripe& stripe : metric_stripes) {
+            total += stripe.commands[kind].load(memory_order_relaxed);
+        }
+        out << "wazzapp_commands_total{command=\"" << command_labels[kind] << "\"} " << total << "\n";
+    }
+    write_counter(out, "wazzapp_messages_sent_total", "Messages written or queued to clients.", total_of(&MetricStripe::messages_sent));
+    write_counter(out, "wazzapp_messages_dropped_total", "Messages dropped because a client's outbound queue was full.", total_of(&MetricStripe::messages_dropped));
+    write_counter(out, "wazzapp_slow_client_disconnects_total", "Clients disconnected because their outbound queue was full.", total_of(&MetricStripe::slow_disconnects));
+    write_counter(out, "wazzapp_offline_messages_stored_total", "Private messages stored for offline users.", total_of(&MetricStripe::offline_stored));
+    write_counter(out, "wazzapp_offline_messages_delivered_total", "Stored messages delivered on login.", total_of(&MetricStripe::offline_delivered));
+    write_counter(out, "wazzapp_log_records_dropped_total", "Log records dropped because the log ring was full.", log_ring.dropped.load(memory_order_relaxed));
+    write_histogram(out, "wazzapp_login_seconds", "Time to check a password and register the client.", &MetricStripe::login_ns, 1000, 10000000000ull, 1e-9);
+    write_histogram(out, "wazzapp_command_seconds", "Time to handle one command.", &MetricStripe::command_ns, 1000, 10000000000ull, 1e-9);
+    write_histogram(out, "wazzapp_fanout_recipients", "Recipients of one message.", &MetricStripe::fanout, 0, 1 << 20, 1);
+    write_histogram(out, "wazzapp_send_queue_depth", "Messages in a client's outbound queue after queueing one (epoll mode).", &MetricStripe::queue_depth, 0, 1 << 16, 1);
+    return out.str();
+}
+
+//answer every connection to the admin port with the metrics, whatever was requested
+void serve_metrics(int listenfd) {
+    while (true) {
+        int sock = accept(listenfd, nullptr, nullptr);
+        if (sock == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            log_text(LogLevel::Error, "The admin port stopped accepting connections!");
+            return;
+        }
+        timeval timeout{1, 0};
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        char request[BUFFER_SIZE];
+        recv(sock, request, sizeof(request), 0);
+        string body = render_metrics();
+        string response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " + to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+        for (size_t sent = 0; sent < response.size();) {
+            ssize_t n = send(sock, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+            if (n <= 0) {
+                break;
+            }
+            sent += n;
+        }
+        close(sock);
+    }
+}
+
+void print_usage(const char* prog) {
+    cerr << "Usage: " << prog << " [options]\n"
+         << "  --port N               listening port (default: 12345)\n"
+         << "  --mode threads         one thread per client (default)\n"
+         << "  --mode epoll           edge-triggered epoll event loops\n"
+         << "  --mode uring           the event loops on io_uring, epoll if the kernel does not support it\n"
+         << "  --loops N              number of event loop threads in epoll mode (default: number of cores)\n"
+         << "  --reuseport            shard clients across the event loops with one SO_REUSEPORT listener per loop\n"
+         << "  --workers N            run commands on N worker threads instead of the event loops in epoll mode (default: 0)\n"
+         << "  --users FILE           credentials file, reloaded whenever it changes (default: users.txt)\n"
+         << "  --protocol text        every recv is one command (default)\n"
+         << "  --protocol framed      varint length + opcode + payload frames, see README.md\n"
+         << "  --max-frame BYTES      largest frame accepted in framed mode (default: 1048576)\n"
+         << "  --queue-slots N        messages queued per client in epoll mode (default: 1024)\n"
+         << "  --queue-bytes BYTES    bytes queued per client in epoll mode (default: 4194304)\n"
+         << "  --backpressure POLICY  drop, disconnect or coalesce when a client's queue is full (default: drop)\n"
+         << "  --zerocopy BYTES       send messages of at least BYTES with MSG_ZEROCOPY in epoll mode (default: off)\n"
+         << "  --admin-port N         serve metrics in Prometheus text format on 127.0.0.1:N (default: off)\n"
+         << "  --log-level LEVEL      debug, info, warn, error or off (default: info, which logs every message)\n"
+         << "  --history N            recent messages kept per group for /history, 0 turns it off (default: 32)\n"
+         << "  --history-bytes BYTES  bytes of recent messages kept per group (default: 4096)\n"
+         << "  --store DIR            keep private messages for offline users in DIR and deliver them on login (default: off)\n"
+         << "  --store-segment BYTES  size of a store segment file (default: 67108864)\n"
+         << "  --rate-limit LIST      per client token buckets, command=rate[:burst] separated by commas, all= for every\n"
+         << "                         command together, or off (default: broadcast=5:20)\n"
+         << "  --max-connections N    refuse new connections while N are open (default: 0, unlimited)\n"
+         << "  --max-groups N         refuse new group names once N groups were created, 0 is unlimited (default: 100000)\n"
+         << "  --login-attempts N     failed logins before a connection is closed, 0 is unlimited (default: 3)\n"
+         << "  --login-throttle N[/S] refuse logins of a username after N failures within S seconds (default: off, S: 60)\n"
+         << "  --login-timeout S      close connections that have not logged in after S seconds, 0 is unlimited (default: 60)\n"
+         << "  --idle-timeout S       close connections without input for S seconds, 0 is unlimited (default: 300)\n"
+         << "  --ping-interval S      ping logged in clients without input for S seconds, 0 is off (default: 60)\n"
+         << "  --verify-threads N     threads checking hashed passwords (default: one per core)\n"
+         << "  --hash-users FILE      print FILE with its plain passwords replaced by yescrypt hashes, then exit\n"
+         << "  --hash-cost N          yescrypt cost of --hash-users, every step doubles time and memory (default: 5)\n"
+         << "  --drain-timeout S      on SIGTERM or SIGINT wait up to S seconds for the clients' output to be written (default: 10)\n"
+         << "  --handoff PATH         hot restart: take the clients over from the server listening on the UNIX socket PATH,\n"
+         << "                         then listen there for the next one (default: off)\n";
+}
+
+//parse a --rate-limit list like "broadcast=5:20,msg=50,all=100:200" (command=rate[:burst]), or "off", returns false if it is invalid
+bool parse_rate_limits(const string& list) {
+    for (RateLimit& limit : config.rate_limits) {
+        limit = RateLimit();
+    }
+    if (list == "off") {
+        return true;
+    }
+    stringstream entries(list);
+    string entry;
+    while (getline(entries, entry, ',')) {
+        size_t eq = entry.find('=');
+        if (eq == string::npos) {
+            return false;
+        }
+        string name = entry.substr(0, eq);
+        int kind = 0;
+        while (kind < CMD_UNKNOWN && name != command_labels[kind]) {
+            kind++;
+        }
+        if (name == "all") {
+            kind = CMD_KINDS;
+        } else if (kind == CMD_UNKNOWN) {
+            return false;
+        }
+        RateLimit& limit = config.rate_limits[kind];
+        limit.rate = atof(entry.c_str() + eq + 1);
+        size_t colon = entry.find(':', eq);
+        limit.burst = colon == string::npos ? max(1.0, limit.rate) : atof(entry.c_str() + colon + 1);
+        if (limit.rate < 0 || (limit.rate > 0 && limit.burst < 1)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+string hash_users_path; //--hash-users: hash this users file to stdout and exit
+
+//parse the command line into config, returns false on invalid arguments
+bool parse_args(int argc, char* argv[]) {
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--mode" && i + 1 < argc) {
+            string mode = argv[++i];
+            if (mode == "threads") {
+                config.mode = ServerMode::Threads;
+            } else if (mode == "epoll") {
+                config.mode = ServerMode::Epoll;
+            } else if (mode == "uring") {
+                config.mode = ServerMode::Uring;
+            } else {
+                return false;
+            }
+        } else if (arg == "--port" && i + 1 < argc) {
+            config.port = atoi(argv[++i]);
+            if (config.port <= 0 || config.port > 65535) {
+                return false;
+            }
+        } else if (arg == "--admin-port" && i + 1 < argc) {
+            config.admin_port = atoi(argv[++i]);
+            if (config.admin_port <= 0 || config.admin_port > 65535) {
+                return false;
+            }
+        } else if (arg == "--log-level" && i + 1 < argc) {
+            string level = argv[++i];
+            if (level == "debug") {
+                config.log_level = LogLevel::Debug;
+            } else if (level == "info") {
+                config.log_level = LogLevel::Info;
+            } else if (level == "warn") {
+                config.log_level = LogLevel::Warn;
+            } else if (level == "error") {
+                config.log_level = LogLevel::Error;
+            } else if (level == "off") {
+                config.log_level = LogLevel::Off;
+            } else {
+                return false;
+            }
+        } else if (arg == "--history" && i + 1 < argc) {
+            long long n = atoll(argv[++i]);
+            if (n < 0) {
+                return false;
+            }
+            config.history_messages = n;
+        } else if (arg == "--history-bytes" && i + 1 < argc) {
+            long long bytes = atoll(argv[++i]);
+            if (bytes <= 0) {
+                return false;
+            }
+            config.history_bytes = bytes;
+        } else if (arg == "--store" && i + 1 < argc) {
+            config.store_dir = argv[++i];
+        } else if (arg == "--store-segment" && i + 1 < argc) {
+            long long bytes = atoll(argv[++i]);
+            if (bytes < 4096) {
+                return false;
+            }
+            config.store_segment = bytes;
+        } else if (arg == "--loops" && i + 1 < argc) {
+            config.loops = atoi(argv[++i]);
+            if (config.loops <= 0) {
+                return false;
+            }
+        } else if (arg == "--workers" && i + 1 < argc) {
+            config.workers = atoi(argv[++i]);
+            if (config.workers < 0) {
+                return false;
+            }
+        } else if (arg == "--rate-limit" && i + 1 < argc) {
+            if (!parse_rate_limits(argv[++i])) {
+                return false;
+            }
+        } else if (arg == "--max-connections" && i + 1 < argc) {
+            config.max_connections = atoi(argv[++i]);
+            if (config.max_connections < 0) {
+                return false;
+            }
+        } else if (arg == "--max-groups" && i + 1 < argc) {
+            config.max_groups = atoi(argv[++i]);
+            if (config.max_groups < 0) {
+                return false;
+            }
+        } else if (arg == "--login-attempts" && i + 1 < argc) {
+            config.login_attempts = atoi(argv[++i]);
+            if (config.login_attempts < 0) {
+                return false;
+            }
+        } else if (arg == "--login-throttle" && i + 1 < argc) {
+            //N or N/SECONDS
+            string throttle = argv[++i];
+            size_t slash = throttle.find('/');
+            config.login_throttle = atoi(throttle.c_str());
+            if (slash != string::npos) {
+                config.login_window = atoi(throttle.c_str() + slash + 1);
+            }
+            if (config.login_throttle < 0 || config.login_window <= 0) {
+                return false;
+            }
+        } else if ((arg == "--login-timeout" || arg == "--idle-timeout" || arg == "--ping-interval") && i + 1 < argc) {
+            int seconds = atoi(argv[++i]);
+            if (seconds < 0) {
+                return false;
+            }
+            (arg == "--login-timeout" ? config.login_timeout : arg == "--idle-timeout" ? config.idle_timeout : config.ping_interval) = seconds;
+        } else if (arg == "--verify-threads" && i + 1 < argc) {
+            config.verify_threads = atoi(argv[++i]);
+            if (config.verify_threads <= 0) {
+                return false;
+            }
+        } else if (arg == "--hash-users" && i + 1 < argc) {
+            hash_users_path = argv[++i];
+        } else if (arg == "--hash-cost" && i + 1 < argc) {
+            config.hash_cost = atoi(argv[++i]);
+            if (config.hash_cost <= 0) {
+                return false;
+            }
+        } else if (arg == "--drain-timeout" && i + 1 < argc) {
+            config.drain_timeout = atoi(argv[++i]);
+            if (config.drain_timeout < 0) {
+                return false;
+            }
+        } else if (arg == "--handoff" && i + 1 < argc) {
+            config.handoff_path = argv[++i];
+            if (config.handoff_path.empty() || config.handoff_path.size() >= sizeof(sockaddr_un::sun_path)) {
+                return false;
+            }
+        } else if (arg == "--reuseport") {
+            config.reuseport = true;
+        } else if (arg == "--users" && i + 1 < argc) {
+            config.users_file = argv[++i];
+        } else if (arg == "--protocol" && i + 1 < argc) {
+            string protocol = argv[++i];
+            if (protocol == "text") {
+                config.protocol = Protocol::Text;
+            } else if (protocol == "framed") {
+                config.protocol = Protocol::Framed;
+            } else {
+                return false;
+            }
+        } else if (arg == "--queue-slots" && i + 1 < argc) {
+            long long slots = atoll(argv[++i]);
+            if (slots < 1) {
+                return false;
+            }
+            config.queue_slots = slots;
+        } else if (arg == "--queue-bytes" && i + 1 < argc) {
+            long long bytes = atoll(argv[++i]);
+            if (bytes < 1) {
+                return false;
+            }
+            config.queue_bytes = bytes;
+        } else if (arg == "--backpressure" && i + 1 < argc) {
+            string policy = argv[++i];
+            if (policy == "drop") {
+                config.backpressure = Backpressure::Drop;
+            } else if (policy == "disconnect") {
+                config.backpressure = Backpressure::Disconnect;
+            } else if (policy == "coalesce") {
+                config.backpressure = Backpressure::Coalesce;
+            } else {
+                return false;
+            }
+        } else if (arg == "--zerocopy" && i + 1 < argc) {
+            long long bytes = atoll(argv[++i]);
+            if (bytes < 0) {
+                return false;
+            }
+            config.zerocopy = bytes;
+        } else if (arg == "--max-frame" && i + 1 < argc) {
+            long long bytes = atoll(argv[++i]);
+            if (bytes < 2) {
+                return false;
+            }
+            config.max_frame = bytes;
+        } else {
+            return false;
+        }
+    }
+    //sharded listeners and workers only make sense with event loops
+    if ((config.reuseport || config.workers > 0) && config.mode == ServerMode::Threads) {
+        return false;
+    }
+    return true;
+}
+
+//create, bind and listen on the server socket, exits with the usual error codes on failure
+int create_listener(bool reuseport, const char* address = "0.0.0.0", int port = config.port) {
+    //create server socket to listen to clients
+    int server_socket;
+    server_socket = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC | (reuseport ? SOCK_NONBLOCK : 0), 0);
+    if (server_socket == -1){
+        cerr <<"Error: Can not create socket\n" << endl;
+        exit(1);
+    }
+    //connections closed by the server linger in TIME_WAIT, they must not keep a restarted server from binding
+    int on = 1;
+    setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (reuseport) {
+        setsockopt(server_socket, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+    }
+
+    //define server socket address using ip and port
+    sockaddr_in serv_sock_addr{};
+    serv_sock_addr.sin_family = AF_INET;
+    serv_sock_addr.sin_port = htons(port);
+    inet_pton(AF_INET, address, &serv_sock_addr.sin_addr);
+
+    //bind the socket to ip and port
+    if(bind(server_socket, (sockaddr*)&serv_sock_addr, sizeof(serv_sock_addr)) == -1){
+        cerr << "Error: Can not bind to IP/Port\n" <<endl;
+        exit(2);
+    }
+    //start listening on the socket
+    if (listen(server_socket, SOMAXCONN) == -1){
+        cerr << "Error: Can't listen via socket\n" <<endl;
+        exit(3);
+    }
+    return server_socket;
+}
+
+//accept every pending connection on a listening socket of the main thread, a client gets a thread of its own or one of
+//the event loops in round robin order
+void accept_pending(int listenfd, size_t& next_loop) {
+    while (true) {
+        //awaits a connection, and upon recieving one creates a new socket to communicate
+        int client_socket = accept(listenfd, nullptr, nullptr);
+        if (client_socket == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return;
+            }
+            cerr << "Error: Problem with client connecting!\n" <<endl;
+            exit(4);
+        }
+
+        if (!admit_connection(client_socket)) {
+            continue;
+        }
+
+        if (config.mode != ServerMode::Threads) {
+            //hand the client to the event loops in round robin order
+            EventLoop* loop = event_loops[next_loop++ % event_loops.size()].get();
+            loop->post([loop, client_socket] { loop->add_session(client_socket); });
+            continue;
+        }
+
+        //On successful connection of client to the server, create a new thread for the client and then call the function to handle the client
+        if (!open_socket(client_socket, nullptr)) {
+            continue;
+        }
+        Session* session = new Session();
+        session->sock = client_socket;
+        session->epoch = socket_slots[client_socket].epoch.load();
+        start_client_thread(session, false);
+    }
+}
+
+//run f on the thread of every event loop and wait for all of them, true if it returned true on every loop
+bool on_loops(const function<bool(EventLoop&)>& f) {
+    vector<future<bool>> results;
+    for (auto& loop : event_loops) {
+        auto done = make_shared<promise<bool>>();
+        results.push_back(done->get_future());
+        EventLoop* l = loop.get();
+        l->post([l, done, &f] { done->set_value(f(*l)); });
+    }
+    bool all = true;
+    for (auto& result : results) {
+        all = result.get() && all;
+    }
+    return all;
+}
+
+//hot restart: stop every client between two messages and wait until nothing is in flight, false if that takes too long
+bool freeze_clients() {
+    uint64_t deadline = now_ns() + HANDOFF_FREEZE_MS * 1000000ull;
+    if (!event_loops.empty()) {
+        on_loops([](EventLoop& loop) { loop.freeze(); return true; });
+        while (!on_loops([](EventLoop& loop) { return loop.quiet(); })) {
+            if (now_ns() > deadline) {
+                return false;
+            }
+            this_thread::sleep_for(chrono::milliseconds(5));
+        }
+        return true;
+    }
+
+    //thread mode: the timers stop after the one running now, and a thread waiting in recv is interrupted until it parks
+    client_threads.frozen = true;
+    {
+        lock_guard<mutex> lock(timer_mutex);
+    }
+    unique_lock<mutex> lock(client_threads.lock);
+    while (client_threads.parked < client_threads.running) {
+        if (now_ns() > deadline) {
+            return false; //most likely a thread blocked writing to a client that does not read
+        }
+        for (Session* session : client_threads.sessions) {
+            pthread_kill(session->thread, SIGUSR1);
+        }
+        client_threads.changed.wait_for(lock, chrono::milliseconds(10));
+    }
+    return true;
+}
+
+//the takeover failed, serve the clients again
+void thaw_clients() {
+    if (!event_loops.empty()) {
+        on_loops([](EventLoop& loop) { loop.thaw(); return true; });
+        return;
+    }
+    lock_guard<mutex> lock(client_threads.lock);
+    client_threads.frozen = false;
+    client_threads.changed.notify_all();
+}
+
+//hot restart: the groups (with their history) and the clients of the frozen server, the clients' sockets in the same order
+void save_state(string& state, vector<int>& socks) {
+    StateWriter groups;
+    size_t groupCount = 0;
+    Symbol names = symbols.count.load();
+    for (Symbol group_id = 0; group_id < names; group_id++) {
+        Group* group = find_group(group_id);
+        if (!group) {
+            continue;
+        }
+        shared_lock<shared_mutex> lock(group->lock);
+        if (group->deleted) {
+            continue;
+        }
+        lock_guard<mutex> historyLock(group->history_lock);
+        const History& history = group->history;
+        groups.text(symbols.name(group_id));
+        groups.number(history.added - history.first_held(history.added));
+        history.for_each([&](string_view text) { groups.text(text); });
+        groupCount++;
+    }
+
+    //every loop writes its own clients
+    StateWriter clients;
+    if (!event_loops.empty()) {
+        vector<StateWriter> parts(event_loops.size());
+        vector<vector<int>> owned(event_loops.size());
+        on_loops([&](EventLoop& loop) {
+            loop.save_sessions(parts[loop.index], owned[loop.index]);
+            return true;
+        });
+        for (size_t i = 0; i < parts.size(); i++) {
+            clients.out += parts[i].out;
+            socks.insert(socks.end(), owned[i].begin(), owned[i].end());
+        }
+    } else {
+        lock_guard<mutex> lock(client_threads.lock);
+        for (Session* session : client_threads.sessions) {
+            save_session(clients, *session);
+            socks.push_back(session->sock);
+        }
+    }
+
+    StateWriter w;
+    w.number(groupCount);
+    w.out += groups.out;
+    w.number(socks.size());
+    w.out += clients.out;
+    state = move(w.out);
+}
+
+//send sockets over a UNIX socket, they arrive in the other process as descriptors of the same connections
+bool send_fds(int conn, const int* fds, size_t n) {
+    char byte = 0;
+    iovec iov{&byte, 1};
+    alignas(cmsghdr) char control[CMSG_SPACE(HANDOFF_FDS * sizeof(int))];
+    msghdr mh{};
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control;
+    mh.msg_controllen = CMSG_SPACE(n * sizeof(int));
+    cmsghdr* cm = CMSG_FIRSTHDR(&mh);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(n * sizeof(int));
+    memcpy(CMSG_DATA(cm), fds, n * sizeof(int));
+    return sendmsg(conn, &mh, MSG_NOSIGNAL) == 1;
+}
+
+//receive the sockets of one send_fds and append them to fds, false on failure
+bool recv_fds(int conn, vector<int>& fds) {
+    char byte;
+    iovec iov{&byte, 1};
+    alignas(cmsghdr) char control[CMSG_SPACE(HANDOFF_FDS * sizeof(int))];
+    msghdr mh{};
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control;
+    mh.msg_controllen = sizeof(control);
+    if (recvmsg(conn, &mh, MSG_CMSG_CLOEXEC) != 1 || (mh.msg_flags & MSG_CTRUNC)) {
+        return false;
+    }
+    for (cmsghdr* cm = CMSG_FIRSTHDR(&mh); cm != nullptr; cm = CMSG_NXTHDR(&mh, cm)) {
+        if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS) {
+            size_t n = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            const int* received = (const int*)CMSG_DATA(cm);
+            fds.insert(fds.end(), received, received + n);
+        }
+    }
+    return true;
+}
+
+sockaddr_un handoff_address() {
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, config.handoff_path.c_str(), config.handoff_path.size()); //shorter than sun_path, see parse_args
+    return addr;
+}
+
+//hot restart, old side: a new process connected to the handoff socket, stop the clients, send it the listening sockets,
+//the clients' sockets and the state, and exit once it has them, returns if the takeover failed and the server carries on
+//the exchange: hello (version, protocol, port) >, < header (accepted, state bytes, listeners, sockets) or refusal,
+//< state in chunks, < sockets, listeners first, ack >, and the connection closes when this process exits
+void hand_over(int conn, const vector<int>& listeners) {
+    timeval timeout{HANDOFF_TIMEOUT, 0};
+    setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    auto refuse = [conn](const char* reason) {
+        StateWriter w;
+        w.number(0);
+        w.text(reason);
+        send(conn, w.out.data(), w.out.size(), MSG_NOSIGNAL);
+        log_text(LogLevel::Warn, string("Refused a takeover: ") + reason);
+    };
+
+    //only a process of the same user may take over, and only one speaking the same protocol on the same port
+    char hello[64];
+    ssize_t n = recv(conn, hello, sizeof(hello), 0);
+    StateReader r{string_view(hello, max<ssize_t>(n, 0))};
+    ucred peer{};
+    socklen_t len = sizeof(peer);
+    if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &peer, &len) == -1 || peer.uid != getuid()) {
+        refuse("the new process runs as another user");
+        return;
+    }
+    if (r.number() != HANDOFF_VERSION || r.number() != (uint64_t)config.protocol || r.number() != (uint64_t)config.port || !r.ok) {
+        refuse("the new process must use the same --protocol and --port");
+        return;
+    }
+    log_text(LogLevel::Info, "A new server process is taking over, stopping the clients");
+    if (!freeze_clients()) {
+        thaw_clients();
+        refuse("the clients could not be stopped in time");
+        return;
+    }
+
+    vector<int> fds = listeners;
+    for (auto& loop : event_loops) {
+        if (loop->listenfd != -1) {
+            fds.push_back(loop->listenfd);
+        }
+    }
+    size_t listenerCount = fds.size();
+    string state;
+    vector<int> socks;
+    save_state(state, socks);
+    fds.insert(fds.end(), socks.begin(), socks.end());
+
+    StateWriter header;
+    header.number(1);
+    header.number(state.size());
+    header.number(listenerCount);
+    header.number(fds.size());
+    bool sent = send(conn, header.out.data(), header.out.size(), MSG_NOSIGNAL) == (ssize_t)header.out.size();
+    for (size_t at = 0; sent && at < state.size(); at += HANDOFF_CHUNK) {
+        sent = send(conn, state.data() + at, min<size_t>(HANDOFF_CHUNK, state.size() - at), MSG_NOSIGNAL) > 0;
+    }
+    for (size_t at = 0; sent && at < fds.size(); at += HANDOFF_FDS) {
+        sent = send_fds(conn, fds.data() + at, min<size_t>(HANDOFF_FDS, fds.size() - at));
+    }
+    char ack = 0;
+    if (!sent || recv(conn, &ack, 1, 0) != 1) {
+        thaw_clients();
+        log_text(LogLevel::Error, "The takeover failed, serving the clients again");
+        return;
+    }
+
+    //the new process serves the clients from now on, this one only makes sure the store and the log are written
+    flush_store();
+    log_text(LogLevel::Info, "Handed " + to_string(socks.size()) + " client(s) over to the new server process");
+    flush_log();
+    _exit(0);
+}
+
+//what a new process gets from the old one on a hot restart
+struct Handoff {
+    vector<int> listeners;
+    vector<int> socks; //in the order of the clients in state
+    string state;
+};
+
+//hot restart, new side: if a server listens on the handoff socket, take its listening sockets, its clients and its state
+//over, returns false if none answers there, exits if it refuses or the takeover fails
+bool take_over(Handoff& handoff) {
+    int conn = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    sockaddr_un addr = handoff_address();
+    if (conn == -1 || connect(conn, (sockaddr*)&addr, sizeof(addr)) == -1) {
+        if (conn != -1) {
+            close(conn);
+        }
+        return false; //no server there, or a stale socket file of one that is gone
+    }
+    cout << "Taking over from the server at " << config.handoff_path << "...\n" << endl;
+    timeval timeout{HANDOFF_TIMEOUT, 0};
+    setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    StateWriter hello;
+    hello.number(HANDOFF_VERSION);
+    hello.number((uint64_t)config.protocol);
+    hello.number(config.port);
+    send(conn, hello.out.data(), hello.out.size(), MSG_NOSIGNAL);
+
+    string chunk(HANDOFF_CHUNK, '\0');
+    ssize_t n = recv(conn, chunk.data(), chunk.size(), 0);
+    StateReader header{string_view(chunk.data(), max<ssize_t>(n, 0))};
+    uint64_t accepted = header.number();
+    if (header.ok && accepted == 0) {
+        cerr << "Error: The running server refused the takeover: " << header.text() << "\n" << endl;
+        exit(6);
+    }
+    uint64_t stateBytes = header.number();
+    uint64_t listeners = header.number();
+    uint64_t sockets = header.number();
+    bool ok = header.ok && accepted == 1 && listeners <= sockets;
+    while (ok && handoff.state.size() < stateBytes) {
+        n = recv(conn, chunk.data(), chunk.size(), 0);
+        ok = n > 0;
+        if (ok) {
+            handoff.state.append(chunk.data(), n);
+        }
+    }
+    vector<int> fds;
+    while (ok && fds.size() < sockets) {
+        ok = recv_fds(conn, fds);
+    }
+    char ack = 1;
+    if (!ok || fds.size() != sockets || send(conn, &ack, 1, MSG_NOSIGNAL) != 1) {
+        cerr << "Error: Taking over from the running server failed\n" << endl;
+        exit(6);
+    }
+
+    //the old process is done once the connection closes: it exited, its store is written and the port is ours
+    timeval forever{0, 0};
+    setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &forever, sizeof(forever));
+    while (recv(conn, &ack, 1, 0) == -1 && errno == EINTR) {
+    }
+    close(conn);
+    handoff.listeners.assign(fds.begin(), fds.begin() + listeners);
+    handoff.socks.assign(fds.begin() + listeners, fds.end());
+    return true;
+}
+
+//hot restart, new side: bring the groups back and serve the clients handed over, before any client thread or loop runs
+void restore_state(const Handoff& handoff) {
+    StateReader r{handoff.state};
+    uint64_t groups = r.number();
+    for (uint64_t i = 0; i < groups && r.ok; i++) {
+        string_view name = r.text();
+        auto group = make_unique<Group>();
+        group->deleted = false;
+        uint64_t messages = r.number();
+        for (uint64_t j = 0; j < messages && r.ok; j++) {
+            group->history.add(r.text());
+        }
+        Symbol group_id = r.ok ? symbols.intern(name) : NO_SYMBOL;
+        if (group_id != NO_SYMBOL) {
+            symbols.entry(group_id).group.store(group.release(), memory_order_release);
+            group_count++; //held by the old process already, so not refused by --max-groups
+        }
+    }
+    groups_version++;
+
+    //the threads start once every client is back in clients and in its groups
+    uint64_t count = r.number();
+    vector<Session*> threads;
+    size_t restored = 0;
+    for (size_t i = 0; i < handoff.socks.size(); i++) {
+        int sock = handoff.socks[i];
+        SessionImage image;
+        if (i >= count || !read_session(r, image)) {
+            close(sock); //a damaged state, the client has to connect again
+            continue;
+        }
+        open_connections++; //admitted by the old process already
+        restored++;
+        if (!event_loops.empty()) {
+            event_loops[i % event_loops.size()]->adopt_session(sock, image);
+            continue;
+        }
+        if (!open_socket(sock, nullptr)) {
+            continue;
+        }
+        fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) & ~O_NONBLOCK); //the old process may have served it with an event loop
+        Session* session = new Session();
+        session->sock = sock;
+        session->epoch = socket_slots[sock].epoch.load();
+        restore_session(*session, image);
+        threads.push_back(session);
+    }
+    for (Session* session : threads) {
+        start_client_thread(session, true);
+    }
+    cout << "Took over " << restored << " client(s) and " << groups << " group(s).\n" << endl;
+}
+
+//hot restart: listen on the handoff socket for the next process to take over, -1 if that is not possible
+int listen_handoff() {
+    sockaddr_un addr = handoff_address();
+    unlink(addr.sun_path);
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    //only the same user may connect, the peer's credentials are checked as well
+    if (fd == -1 || bind(fd, (sockaddr*)&addr, sizeof(addr)) == -1 || chmod(addr.sun_path, 0600) == -1 || listen(fd, 1) == -1) {
+        cerr << "Warning: Can not listen on " << config.handoff_path << ", hot restart is off\n" << endl;
+        if (fd != -1) {
+            close(fd);
+        }
+        return -1;
+    }
+    return fd;
+}
+
+//SIGTERM or SIGINT: stop accepting, tell every client, write what is queued for it and close it, then exit once every
+//connection is closed or --drain-timeout is up, another signal meanwhile exits at once
+[[noreturn]] void shut_down(int signal_fd, const vector<int>& listeners) {
+    log_text(LogLevel::Info, "Shutting down, closing " + to_string(open_connections.load()) + " connection(s)");
+    shutting_down = true;
+    for (int fd : listeners) {
+        close(fd);
+    }
+    const char* notice = "Server is shutting down.\n";
+    if (event_loops.empty()) {
+        lock_guard<mutex> lock(client_threads.lock);
+        for (Session* session : client_threads.sessions) {
+            try_send_text(session->sock, notice);
+            shutdown(session->sock, SHUT_RDWR); //recv returns 0 and the client's thread closes it
+        }
+    } else {
+        MsgBuf msg = make_msg(notice);
+        for (auto& loop : event_loops) {
+            EventLoop* l = loop.get();
+            l->post([l, msg] { l->begin_close(msg); });
+        }
+    }
+
+    uint64_t deadline = now_ns() + seconds_ns(config.drain_timeout);
+    pollfd again{signal_fd, POLLIN, 0};
+    while (open_connections.load() > 0 && now_ns() < deadline && poll(&again, 1, 10) == 0) {
+    }
+    flush_store();
+    log_text(LogLevel::Info, "Server stopped");
+    flush_log();
+    _exit(0);
+}
+
+#ifndef WAZZAPP_NO_MAIN
+int main(int argc, char* argv[])
+{   //read the startup options
+    if (!parse_args(argc, argv)) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    if (!hash_users_path.empty()) {
+        return hash_users_file(hash_users_path);
+    }
+
+    //a client closing its socket while we write to it must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+
+    //SIGTERM and SIGINT start a graceful shutdown: blocked in every thread, the main thread reads them from a signalfd
+    sigset_t stopSignals;
+    sigemptyset(&stopSignals);
+    sigaddset(&stopSignals, SIGTERM);
+    sigaddset(&stopSignals, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &stopSignals, nullptr);
+    int signal_fd = signalfd(-1, &stopSignals, SFD_CLOEXEC);
+    //thread mode: SIGUSR1 ends the recv of a client thread when a hot restart stops the clients
+    struct sigaction interrupt{};
+    interrupt.sa_handler = interrupt_client;
+    sigaction(SIGUSR1, &interrupt, nullptr);
+
+    //everything logged after startup goes through the log ring
+    thread(drain_log).detach();
+
+    //load the credentials once, later changes of the file are picked up by the watcher
+    auto index = load_users(config.users_file);
+    if (!index) {
+        cerr << "Warning: Can not open " << config.users_file << ", no user can log in until it is created\n" << endl;
+        index = make_shared<UserIndex>();
+    }
+    users.store(index);
+    cout << "Loaded " << index->size() << " users from " << config.users_file << "\n" << endl;
+    thread(watch_users, config.users_file).detach();
+    verifier = make_unique<Verifier>(config.verify_threads);
+
+    //hot restart: a server running at the handoff socket hands its clients over, and exits before the store or a port is opened
+    Handoff handoff;
+    bool tookOver = !config.handoff_path.empty() && take_over(handoff);
+
+    //messages for offline users survive restarts
+    if (!config.store_dir.empty() && !open_store()) {
+        cerr << "Error: Can not open the message store in " << config.store_dir << "\n" << endl;
+        return 5;
+    }
+
+    //one slot per possible socket number
+    rlimit limit{};
+    getrlimit(RLIMIT_NOFILE, &limit);
+    socket_slot_count = (int)min<rlim_t>(limit.rlim_cur, 1 << 20);
+    socket_slots = make_unique<SocketSlot[]>(socket_slot_count);
+
+    //metrics for Prometheus, only reachable from this machine
+    if (config.admin_port > 0) {
+        int adminSocket = create_listener(false, "127.0.0.1", config.admin_port);
+        thread(serve_metrics, adminSocket).detach();
+        cout << "Serving metrics on 127.0.0.1:" << config.admin_port << "\n" << endl;
+    }
+
+    //in thread mode the timeouts of every client are run by one thread
+    if (config.mode == ServerMode::Threads && (config.login_timeout > 0 || config.idle_timeout > 0 || config.ping_interval > 0)) {
+        thread(run_thread_timers).detach();
+    }
+
+    //io_uring needs a recent kernel, without one the same event loops run on epoll
+    if (config.mode == ServerMode::Uring && !uring_supported()) {
+        cout << "io_uring is not available, using epoll instead.\n" << endl;
+        config.mode = ServerMode::Epoll;
+    }
+
+    //in epoll mode a fixed set of event loops serves every client, optionally with a fixed set of workers running the commands
+    if (config.mode != ServerMode::Threads) {
+        for (int i = 0; i < config.loops; i++) {
+            event_loops.push_back(make_unique<EventLoop>());
+        }
+    }
+    if (config.workers > 0) {
+        executor = make_unique<Executor>(config.workers);
+        cout << "Running commands on " << config.workers << " worker thread(s).\n" << endl;
+    }
+
+    //with --reuseport every loop listens on its own socket and the kernel spreads the clients over them, listeners
+    //handed over beyond the loops are accepted on by the main thread, like the single listener without --reuseport
+    vector<int> listeners = handoff.listeners;
+    if (config.reuseport) {
+        int shared = 1;
+        socklen_t len = sizeof(shared);
+        if (!listeners.empty()) {
+            getsockopt(listeners[0], SOL_SOCKET, SO_REUSEPORT, &shared, &len); //loops beyond them get a listener only if it is shared
+        }
+        for (auto& loop : event_loops) {
+            if (!listeners.empty()) {
+                loop->listenfd = listeners.back();
+                listeners.pop_back();
+                fcntl(loop->listenfd, F_SETFL, fcntl(loop->listenfd, F_GETFL) | O_NONBLOCK);
+            } else if (shared) {
+                loop->listenfd = create_listener(true);
+            } else {
+                break;
+            }
+            epoll_event ev{};
+            ev.events = EPOLLIN | EPOLLET;
+            ev.data.fd = loop->listenfd;
+            epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->listenfd, &ev);
+        }
+    } else if (listeners.empty()) {
+        listeners.push_back(create_listener(false));
+    }
+    for (int fd : listeners) {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    }
+    cout << "Server is listening for incoming clients on port number " << config.port << "...\n" << endl;
+    if (tookOver) {
+        restore_state(handoff);
+    }
+    if (config.mode != ServerMode::Threads) {
+        for (auto& loop : event_loops) {
+            EventLoop* l = loop.get();
+            l->worker = thread([l] { l->run(); });
+        }
+        cout << "Running " << config.loops << (config.mode == ServerMode::Uring ? " io_uring" : " epoll") << " event loop(s)" << (config.reuseport ? ", each with its own listener" : "") << ".\n" << endl;
+    }
+    int handoff_fd = config.handoff_path.empty() ? -1 : listen_handoff();
+
+    //the main thread accepts on the listeners no event loop owns, and waits for a shutdown signal or a new process taking over
+    size_t next_loop = 0;
+    vector<pollfd> watched;
+    while (true) {
+        watched.assign({{signal_fd, POLLIN, 0}, {handoff_fd, POLLIN, 0}});
+        for (int fd : listeners) {
+            watched.push_back({fd, POLLIN, 0});
+        }
+        if (poll(watched.data(), watched.size(), -1) == -1) {
+            continue; //EINTR
+        }
+        if (watched[0].revents) {
+            shut_down(signal_fd, listeners);
+        }
+        if (watched[1].revents) {
+            int conn = accept4(handoff_fd, nullptr, nullptr, SOCK_CLOEXEC);
+            if (conn != -1) {
+                hand_over(conn, listeners);
+                close(conn);
+            }
+        }
+        for (size_t i = 2; i < watched.size(); i++) {
+            if (watched[i].revents) {
+                accept_pending(watched[i].fd, next_loop);
+            }
+        }
+    }
+    return 0;
+}
+#endif